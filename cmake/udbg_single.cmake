@@ -0,0 +1,44 @@
+# glue udbg_bits.h, udbg.h and udbg.c into one header
+# usage: cmake -DSOURCE_DIR=... -DOUTPUT=... [-DSTATIC_THROW_HOOK=ON] -P udbg_single.cmake
+
+file(READ ${SOURCE_DIR}/udbg_bits.h UDBG_BITS)
+file(READ ${SOURCE_DIR}/udbg.h UDBG_HEADER)
+file(READ ${SOURCE_DIR}/udbg.c UDBG_SOURCE)
+
+string(REPLACE "#include \"udbg_bits.h\"" "" UDBG_HEADER "${UDBG_HEADER}")
+string(REPLACE "#include \"udbg.h\"" "" UDBG_SOURCE "${UDBG_SOURCE}")
+
+# linked into the binary like udbg_static, same clash with a static libstdc++
+if (STATIC_THROW_HOOK)
+    set(UDBG_THROW_HOOK "")
+else ()
+    set(UDBG_THROW_HOOK "#   ifndef UDBG_NO_THROW_HOOK
+#       define UDBG_NO_THROW_HOOK
+#   endif
+")
+endif ()
+
+file(WRITE ${OUTPUT} "/*
+ *  single header udbg, generated from udbg_bits.h, udbg.h
+ *  and udbg.c. include it as udbg.h anywhere, c or c++; in
+ *  exactly one c source file define UDBG_IMPLEMENTATION and
+ *  include it before any system header
+ */
+#ifdef UDBG_IMPLEMENTATION
+#   ifdef __cplusplus
+#       error \"UDBG_IMPLEMENTATION goes in a c source file\"
+#   endif
+${UDBG_THROW_HOOK}#   ifndef _GNU_SOURCE
+#       define _GNU_SOURCE
+#   endif
+#   ifndef UDBG
+#       define UDBG
+#   endif
+#endif
+
+${UDBG_BITS}
+${UDBG_HEADER}
+#ifdef UDBG_IMPLEMENTATION
+${UDBG_SOURCE}
+#endif // UDBG_IMPLEMENTATION
+")
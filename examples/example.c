@@ -0,0 +1,176 @@
+/*
+ *  every public call once, in the order of udbg.h. built with
+ *  the library and run by ctest; also compiled without UDBG,
+ *  where all of it has to go away. udbg_throw() and failing
+ *  asserts end the process and are left out
+ */
+#define _GNU_SOURCE
+
+#include "udbg.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CH 1
+
+
+// sleeps on through the EINTRs the samplers cause
+static void wait_ms(const long ms)
+{
+    struct timespec until = {0};
+    clock_gettime(CLOCK_MONOTONIC, &until);
+
+    until.tv_nsec += ms * 1000000l;
+    until.tv_sec += until.tv_nsec / 1000000000l;
+    until.tv_nsec %= 1000000000l;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL))
+    {
+    }
+}
+
+
+static void *worker(void *arg)
+{
+    (void) arg;
+    udbg_thread_attach();
+
+    udbg_flow_step(7);
+    udbg_queue_probe_dequeue("example.jobs", arg);
+    udbg_log(CH, "worker attached");
+
+    wait_ms(300);
+    return NULL;
+}
+
+
+static void routines(const char *dir)
+{
+    udbg_stack_report(CH);
+    udbg_stack_watch(CH, 1);
+    udbg_stack_watch(CH, 0);
+
+#if defined(UDBG) && !defined(UDBG_NO_SIGNALS)
+    // from "outside": kill() is SI_USER, a dump request
+    udbg_stacks_enable(CH, SIGUSR2);
+    kill(getpid(), SIGUSR2);
+    wait_ms(100);
+#endif
+
+    const uint8_t bytes[40] = {'u', 'd', 'b', 'g', 0, 1, 2, 3};
+    udbg_log(CH, "a number %d", 42);
+    udbg_hexdump(CH, bytes, sizeof(bytes));
+    udbg_fingerprint(CH, bytes, sizeof(bytes));
+    udbg_bindump(CH, bytes, 4);
+
+    const int net = udbg_channel("example.net");
+    udbg_channels_enable("example.*,~example.slow");
+    udbg_logc(net, "named channel %d", net);
+    udbg_logc(udbg_channel("example.slow"), "sampled only");
+
+    udbg_sample_rate(1.0);
+    udbg_channels_sampled(CH);
+    if (udbg_sample_ctx_set(42))
+    {
+        udbg_logc(udbg_channel("example.slow"), "request 42 sampled");
+    }
+    udbg_sample_ctx_clear();
+
+    udbg_rec_t *rec = udbg_rec_begin(CH);
+    udbg_rec_append(rec, "first line");
+    udbg_rec_append(rec, "second line");
+    udbg_rec_hexdump(rec, bytes, 8);
+    udbg_rec_commit(rec);
+
+    char path[4096] = {0};
+    snprintf(path, sizeof(path), "%s/example_h.log", dir);
+
+    udbg_t *h = udbg_open(path, UDBG_TRUNCATE, 0);
+    udbg_log_h(h, CH, "own file");
+    udbg_hexdump_h(h, CH, bytes, 8);
+    udbg_fingerprint_h(h, CH, bytes, sizeof(bytes));
+    udbg_bindump_h(h, CH, bytes, 2);
+    udbg_close(h);
+
+    const float f32[] = {1.5f, -2.0f, 3.25f};
+    const double f64[] = {0.5, 1e300, -7.0};
+    const int32_t i32[] = {-3, 0, 3};
+    const int64_t i64[] = {-1, INT64_MAX, 5};
+    const uint32_t u32[] = {1, 2, UINT32_MAX};
+    const uint64_t u64[] = {0, 1, UINT64_MAX};
+    udbg_arraydump_f32(CH, f32, 3);
+    udbg_arraydump_f64(CH, f64, 3);
+    udbg_arraydump_i32(CH, i32, 3);
+    udbg_arraydump_i64(CH, i64, 3);
+    udbg_arraydump_u32(CH, u32, 3);
+    udbg_arraydump_u64(CH, u64, 3);
+
+    {
+        udbg_budget_scope(CH, 0);
+        udbg_budget_phase("setup");
+        udbg_perf_scope(CH, "example");
+        wait_ms(1);
+    }
+
+    udbg_thread_top(CH, 1, 5);
+    udbg_thread_top(CH, 0, 0);
+    udbg_mem_report(CH);
+    udbg_mem_watch(CH, 1, 0);
+    udbg_mem_watch(CH, 0, 0);
+
+    udbg_flow_begin(7);
+    udbg_queue_probe_enqueue("example.jobs", bytes);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, (void *) bytes);
+
+    // a second of samples, the worker asleep for some of it
+    udbg_wallprof(CH, 100, 1);
+    pthread_join(thread, NULL);
+    wait_ms(1000);
+    udbg_flow_end(7);
+
+    snprintf(path, sizeof(path), "%s/example_trace.json", dir);
+    if (udbg_trace_export(path))
+    {
+        udbg_log(CH, "trace export failed");
+    }
+
+    udbg_assert(bytes[0] == 'u');
+    udbg_assert_eq(net, udbg_channel("example.net"));
+    udbg_assert_ne(net, 0);
+    udbg_assert_lt(1, 2);
+    udbg_assert_le(2, 2);
+    udbg_assert_gt(3.0, 2.5);
+    udbg_assert_ge(sizeof(bytes), 40u);
+    udbg_check(bytes[0] == 'u');
+    udbg_dcheck(bytes[2] == 'b');
+
+    for (int i = 0; i < 4; i++)
+    {
+        udbg_check_sampled(bytes[1] == 'd', 2);
+    }
+
+    udbg_stats(CH);
+}
+
+
+int main(int argc, char **argv)
+{
+    udbg_log(CH, "before udbg_init, kept until it");
+    udbg_init(NULL, UDBG_TIME | UDBG_STACK_PAINT | UDBG_FINGERPRINT, 0);
+
+    routines(argc > 1 ? argv[1] : ".");
+
+    // last: the flusher takes over from here
+    udbg_rt(-1, SCHED_OTHER, 0);
+    udbg_log(CH, "through the ring");
+    udbg_stats(CH);
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ *  the c++ side: throws counted per type and site, asserts on
+ *  class types. linked against libudbg.so, against libudbg.a
+ *  and with UDBG_SINGLE_HEADER against udbg_single.h; those two
+ *  with a static libstdc++, where a second __cxa_throw fails the
+ *  link, unless built with UDBG_STATIC_THROW_HOOK
+ */
+#ifdef UDBG_EXAMPLE_SINGLE
+#   include "udbg_single.h"
+#else
+#   include "udbg.h"
+#endif
+
+#include <stdexcept>
+#include <string>
+
+#define CH 1
+
+
+__attribute__((noinline)) static void parse(const int i)
+{
+    if (i >= 0)
+    {
+        throw std::runtime_error("parse");
+    }
+}
+
+
+__attribute__((noinline)) static void load(const int i)
+{
+    if (i >= 0)
+    {
+        throw std::invalid_argument("load");
+    }
+}
+
+
+int main()
+{
+    udbg_init(NULL, UDBG_THROWS, 0);
+
+    for (int i = 0; i < 3; i++)
+    {
+        try
+        {
+            parse(i);
+        }
+        catch (const std::exception &e)
+        {
+            udbg_log(CH, "caught %s", e.what());
+        }
+
+        try
+        {
+            load(i);
+        }
+        catch (const std::exception &e)
+        {
+            udbg_log(CH, "caught %s", e.what());
+        }
+    }
+
+    const std::string name = "udbg";
+    udbg_assert_eq(name, std::string("udbg"));
+    udbg_assert_lt(name.size(), 8u);
+    udbg_logc(udbg_channel("example.cpp"), "%s", name.c_str());
+
+    udbg_stats(CH);
+    return 0;
+}
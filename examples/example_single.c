@@ -0,0 +1,3 @@
+// the implementation half of udbg_single.h, for example.cpp
+#define UDBG_IMPLEMENTATION
+#include "udbg_single.h"
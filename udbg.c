@@ -1,29 +1,94 @@
 // strerrorname_np(), sigabbrev_np()
-#define _GNU_SOURCE
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+// pull in the real declarations, not the empty stubs
+#ifndef UDBG
+#   define UDBG
+#endif
 
 #include "udbg.h"
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <pthread.h>
 #include <execinfo.h>
 #include <limits.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <semaphore.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 // convenience
 #define is_set(mask, attr) ({ ((mask) & (attr)); })
 
+// sizes below can be overridden at build time, see CMakeLists.txt
+#ifndef UDBG_BUF_LEN
 #define UDBG_BUF_LEN        65536               // real
+#endif
 #define UDBG_BUF            (UDBG_BUF_LEN + 1)  // used
 #define UDBG_BUF_RESERVED   128
+#ifndef UDBG_CALLSTACK
 #define UDBG_CALLSTACK      48
-
+#endif
+#define UDBG_FP_SAMPLE      16                  // bytes kept from each end
+#ifndef UDBG_FP_SEEN
+#define UDBG_FP_SEEN        1024                // power of two
+#endif
+#ifndef UDBG_STACK_SEEN
+#define UDBG_STACK_SEEN     1024                // power of two
+#endif
+#ifndef UDBG_TOP_THREADS
+#define UDBG_TOP_THREADS    1024                // tracked by thread top
+#endif
+#define UDBG_STACK_PATTERN  0xcd                // stack paint
+#define UDBG_STACK_MARGIN   4096                // left unpainted below sp
+#define UDBG_CAPTURE_WAIT   100                 // ms, per thread stack capture
+#define UDBG_CAPTURE_SIGNAL SIGURG              // unless udbg_stacks_enable() picked one
+#ifndef UDBG_WALL_STACKS
+#define UDBG_WALL_STACKS    4096                // power of two, distinct stacks profiled
+#endif
+#ifndef UDBG_TRACE_EVENTS
+#define UDBG_TRACE_EVENTS   65536               // power of two, flow events kept
+#endif
+#ifndef UDBG_QUEUE_ITEMS
+#define UDBG_QUEUE_ITEMS    65536               // power of two, queued items timed
+#endif
+#ifndef UDBG_THROW_SITES
+#define UDBG_THROW_SITES    512                 // power of two
+#endif
+#define UDBG_THROW_SAMPLE   64                  // keep every n-th throw stack
+#ifndef UDBG_EARLY
+#define UDBG_EARLY          16384               // records kept until output is ready
+#endif
+#ifndef UDBG_RT_RING
+#define UDBG_RT_RING        (1 << 20)           // power of two
+#endif
+#define UDBG_RT_POLL        1000000             // ns, flusher idle sleep
+#define UDBG_RT_WAIT        1000                // ms, final drain waits for the flusher
+#define UDBG_NAMED_INDEX    (__UDBG_NAMED_MAX * 2)  // name lookup, power of two
+
+// named channel ids are kept in a uint16_t index, masked by its size
+_Static_assert(__UDBG_NAMED_MAX - 1 <= UINT16_MAX, "__UDBG_NAMED_MAX over 65536");
+_Static_assert((__UDBG_NAMED_MAX & (__UDBG_NAMED_MAX - 1)) == 0, "__UDBG_NAMED_MAX not a power of two");
+
+#ifndef UDBG_NO_SIGNALS
 static const int udbg_signals[] =
         {
                 SIGABRT,
@@ -35,6 +100,7 @@ static const int udbg_signals[] =
                 SIGSYS,
                 SIGTRAP,
         };
+#endif
 
 
 typedef struct
@@ -45,10 +111,15 @@ typedef struct
 } udbg_buf;
 
 
-// main state structure
-typedef struct
+// one output: udbg_init() sets up the main one,
+// udbg_open() any number of independent others
+struct udbg_instance
 {
+    // udbg_open() ones, for fork()
+    struct udbg_instance *next;
+
     uint64_t channels_mask;
+    uint64_t sampled_mask; // on too while the request is sampled
     int fd;
     int options;
 
@@ -57,21 +128,221 @@ typedef struct
     // main output buffer
     udbg_buf buf_output;
 
+    // hashes already dumped in full, guarded by the lock
+#ifndef UDBG_NO_HEXDUMP
+    uint64_t fp_seen[UDBG_FP_SEEN];
+#endif
+};
+
+typedef struct udbg_instance udbg_instance;
+
+
+// main state structure
+typedef struct
+{
+    int initialized;
+    udbg_instance main;
+
+    // until set, main output goes to the early buffer
+    int ready;
+    int early_len;
+    int early_dropped;
+    char early[UDBG_EARLY];
+
+    // real-time mode: records go to a ring, a flusher writes them out
+    struct
+    {
+        uint8_t *ring;
+        uint64_t head; // producers, under the lock
+        uint64_t tail; // whoever holds draining
+
+        // one drainer at a time; set stop for the final drain
+        int draining;
+        int stop;
+
+        // records dropped, ring full: a write here would reorder them
+        uint64_t ring_full;
+
+        // times the hot path had to make a syscall or allocate
+        uint64_t contended;
+        uint64_t allocs;
+
+        // bytes RLIMIT_MEMLOCK kept us from locking
+        uint64_t unlocked;
+
+        // flusher placement, a forked child starts its own
+        int cpu;
+        int policy;
+        int priority;
+
+    } rt;
+
+    // log file as given to udbg_init(), for fork shards
+    char *path;
+
+    // until ready, for a child forked while udbg-init runs
+    char *lazy_path;
+
+    // head sampling: trace ids hashing below this are sampled
+    uint64_t sample_threshold;
+
     // reserved for backtrace
     udbg_buf buf_backtrace;
 
     // malloc() extra space in case we use demangler
     char *buf_demangle;
+    size_t buf_demangle_len;
     char *(*demangler)(const char *input, char *output,
                        size_t *len, int *status);
 
-    // https://sourceware.org/git/?p=glibc.git;a=commitdiff;h=6c57d320484988e87e446e2e60ce42816bf51d53
-    uint8_t *alt_stack;
     void *trace[UDBG_CALLSTACK];
 
+    // stack hashes already printed in full
+    uint64_t stack_seen[UDBG_STACK_SEEN];
+
+    // every perf scope that recorded at least once
+    __udbg_perf_site *perf_sites;
+
+    // running thread top sampler
+    struct top_sampler *top;
+    struct mem_sampler *mem;
+    struct stack_sampler *stack;
+
+#ifndef UDBG_NO_SIGNALS
+    // procfs reads of the crash report, off the alternate stack
+    char crash_scratch[4096];
+#endif
+
+    // attached threads, guarded by the lock
+    struct udbg_thread *threads;
+
+    // open handles, guarded by handles_lock
+    struct udbg_instance *handles;
+
+    // named channels, id zero is never registered
+    struct
+    {
+        int count;
+        const char *names[__UDBG_NAMED_MAX];
+        uint16_t index[UDBG_NAMED_INDEX];
+
+        // enable rules, applied to later registrations too
+        char *rules;
+
+    } named;
+
+    // wall-clock profiler, while one runs
+    struct wall_profiler *wall;
+
+    // flow events, mapped on first use; oldest overwritten
+    struct trace_event *trace_ring;
+    uint64_t trace_next;
+
+    // probed queues, and enqueue times of items in them
+    struct __udbg_queue *queues;
+    struct queue_item *queue_items;
+
+    // stacks of other threads, taken in their own signal handler
+    struct
+    {
+        // one capture at a time: dumps and the profiler share it
+        pthread_mutex_t lock;
+        int signal;
+        int dump_signal;
+        uint64_t installed; // handler on signal n: bit n - 1
+        uint64_t channel;
+        const char *prefix;
+
+        sem_t trigger;
+        sem_t done;
+
+        // thread asked for its stack; claimed by the handler
+        pid_t pending;
+        int depth;
+        void *trace[UDBG_CALLSTACK];
+
+    } capture;
+
 } udbg_state;
 
-static udbg_state state = {0};
+// usable before udbg_init(): records are kept in the early
+// buffer regardless of channel, written out once ready
+// all zero, so it stays in .bss; see state_defaults()
+static udbg_state state =
+        {
+                .main =
+                        {
+                                .lock = PTHREAD_MUTEX_INITIALIZER,
+                        },
+                .capture =
+                        {
+                                .lock = PTHREAD_MUTEX_INITIALIZER,
+                        },
+        };
+
+
+/*
+ *  the non-zero defaults; runs ahead of the other
+ *  constructors, and libraries calling udbg from
+ *  theirs depend on libudbg, so run after it
+ */
+__attribute__((constructor(101))) static void state_defaults()
+{
+    state.main.channels_mask = (uint64_t) (-1);
+    state.main.fd = STDERR_FILENO;
+}
+
+
+// bit1 of named channel enable bytes while the
+// current request is sampled, see udbg_sample_ctx_set()
+__thread uint8_t __udbg_ctx_sampled __attribute__((tls_model("initial-exec")));
+
+
+static inline int channel_on(const udbg_instance *h, const uint64_t channel)
+{
+    const uint64_t mask = h->channels_mask | (__udbg_ctx_sampled ? h->sampled_mask : 0);
+    return is_set(mask, channel) != 0;
+}
+
+
+// per-thread data, released at thread exit
+typedef struct udbg_thread
+{
+    struct udbg_thread *next;
+    pthread_t thread;
+    pid_t tid;
+
+    // usable stack, guard excluded
+    uint8_t *stack_lo;
+    uint8_t *stack_hi;
+    int painted;
+
+    int perf_mode;
+    int perf_fd[__UDBG_PERF_COUNTERS];
+
+    // alternate signal stack, guard page included
+    uint8_t *alt_stack;
+    size_t alt_stack_len;
+
+    // udbg_rec_begin(), allocated on first use
+    struct udbg_rec *rec;
+
+} udbg_thread;
+
+
+// one record being built, see udbg_rec_begin()
+struct udbg_rec
+{
+    int lines;
+    udbg_buf buf;
+};
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread udbg_thread *thread_self = NULL;
+
+// for flow events, gettid() is a syscall every time
+static __thread pid_t trace_tid = 0;
 
 
 // chicanery
@@ -92,7 +363,7 @@ __attribute__((noreturn)) void __udbg_panic(const int fd,
     if (fd == -1)
     {
         const int err_action = errno;
-        const int amt = dprintf(state.fd, "[udbg::%s] panicked at %s():%u %s\n",
+        const int amt = dprintf(state.main.fd, "[udbg::%s] panicked at %s():%u %s\n",
                                 action, f, line, strerrorname_np(err_action));
         if (amt == -1)
         {
@@ -155,6 +426,43 @@ static void buf_snprintf(udbg_buf *ptr, const char *fmt, ...)
 }
 
 
+// integers without vsnprintf, right aligned to width
+static void buf_integer(udbg_buf *ptr, const uint64_t magnitude,
+                        const int negative, const int width)
+{
+    char digits[24];
+    char *it = digits + sizeof(digits);
+
+    uint64_t value = magnitude;
+    do
+    {
+        *--it = (char) ('0' + value % 10);
+        value /= 10;
+
+    } while (value);
+
+    if (negative)
+    {
+        *--it = '-';
+    }
+
+    const int len = (int) (digits + sizeof(digits) - it);
+    const int pad = width > len ? width - len : 0;
+
+    // near the end, leave truncation to buf_snprintf()
+    if (ptr->iterator + pad + len >= UDBG_BUF_LEN)
+    {
+        buf_snprintf(ptr, "%*.*s", width, len, it);
+        return;
+    }
+
+    memset(ptr->buf + ptr->iterator, ' ', pad);
+    memcpy(ptr->buf + ptr->iterator + pad, it, len);
+    ptr->iterator += pad + len;
+    ptr->buf[ptr->iterator] = 0;
+}
+
+
 static void buf_flush(const int fd, udbg_buf *ptr)
 {
     const ssize_t amt = write(fd, ptr->buf, ptr->iterator);
@@ -176,14 +484,16 @@ static void buf_timestamp(const int attr,
         return;
     }
 
+    // localtime() re-checks the timezone file on every call,
+    // localtime_r() only once
     char buf[16] = {0};
-    const struct tm *local = localtime(&ts->tv_sec);
-    if (local == NULL)
+    struct tm local = {0};
+    if (localtime_r(&ts->tv_sec, &local) == NULL)
     {
-        panic("localtime()");
+        panic("localtime_r()");
     }
 
-    const size_t amt = strftime(buf, 16, "%H:%M:%S", local);
+    const size_t amt = strftime(buf, 16, "%H:%M:%S", &local);
     if (amt != 8)
     {
         panic("strftime()");
@@ -193,97 +503,203 @@ static void buf_timestamp(const int attr,
 }
 
 /*
- *  append callstack to output buffer; shorter
- *  names, filters out unresolved symbols
+ *  function name of a backtrace_symbols() entry, demangled
+ *  if possible; NULL for unresolved frames. may point into
+ *  the demangle buffer, valid until the next call
  */
-static void buf_backtrace(udbg_buf *ptr, const int depth)
+static const char *frame_name(char *symbol, int *len, const char **suffix)
 {
-    char **symbols = backtrace_symbols(state.trace, depth);
-    if (symbols == NULL)
+    int name = 0;
+    int name_len = 0;
+    char tail = '+';
+
+    *suffix = "()";
+
+    // find name offset
+    for (int n = 0; symbol[n]; n++)
     {
-        panic("backtrace_symbols()");
+        if (symbol[n] == '(')
+        {
+            name = n + 1;
+            break;
+        }
     }
 
-    for (int i = 0; i < depth; i++)
+    if (symbol[name] == '+')
     {
-        int name = 0;
-        size_t name_len = 0;
-        char tail = '+';
-        char *suffix = "()";
+        return NULL;
+    }
 
-        // find name offset
-        for (int n = 0; symbols[i][n]; n++)
+    // safe to start at +1
+    for (int n = name + 1; symbol[n]; n++)
+    {
+        if (symbol[n] == tail)
         {
-            if (symbols[i][n] == '(')
-            {
-                name = n + 1;
-                break;
-            }
+            name_len = n - name;
+            break;
         }
+    }
 
-        if (symbols[i][name] == '+')
-        {
-            continue;
-        }
+    char *name_str = symbol + name;
+    *len = name_len;
+
+#ifndef UDBG_NO_DEMANGLE
+    if (state.demangler)
+    {
+        // demangle function expects null-terminated string
+        name_str[name_len] = 0;
+
+        // size of the output buffer, it gets realloc()ed if too short
+        int status = 0;
+        size_t demangle_len = state.buf_demangle_len;
+        char *tmp = state.demangler(name_str, state.buf_demangle, &demangle_len, &status);
 
-        // safe to start at +1
-        for (int n = name + 1; symbols[i][n]; n++)
+        switch (status)
         {
-            if (symbols[i][n] == tail)
+            case -1: // allocation error
+            case -3: // invalid args
             {
-                name_len = n - name;
+                panic("demangle()");
                 break;
             }
-        }
-
-        char *name_str = symbols[i] + name;
-        if (state.demangler)
-        {
-            // demangle function expects null-terminated string
-            name_str[name_len] = 0;
 
-            int status = 0;
-            char *tmp = state.demangler(name_str, state.buf_demangle, &name_len, &status);
+            case -2: // demangle failed
+            {
+                break;
+            }
 
-            switch (status)
+            case 0: // success
+            default:
             {
-                case -1: // allocation error
-                case -3: // invalid args
+                if (tmp == NULL)
                 {
-                    panic("demangle()");
-                    break;
+                    panic("demangled_str()");
                 }
 
-                case -2: // demangle failed
-                {
-                    break;
-                }
+                state.buf_demangle = tmp;
+                state.buf_demangle_len = demangle_len;
 
-                case 0: // success
-                default:
-                {
-                    if (tmp == NULL)
-                    {
-                        panic("demangled_str()");
-                    }
-
-                    name_str = tmp;
-                    name_len = UDBG_BUF; // NULL-terminated anyway
-                    suffix = "";
-                }
+                *len = (int) strlen(tmp);
+                *suffix = "";
+                return tmp;
             }
         }
+    }
+#endif
+
+    return name_str;
+}
+
+
+/*
+ *  append callstack to output buffer; shorter
+ *  names, filters out unresolved symbols
+ */
+static void buf_backtrace(udbg_buf *ptr, void **trace, const int depth)
+{
+    char **symbols = backtrace_symbols(trace, depth);
+    if (symbols == NULL)
+    {
+        panic("backtrace_symbols()");
+    }
+
+    for (int i = 0; i < depth; i++)
+    {
+        int len = 0;
+        const char *suffix = NULL;
+        const char *name = frame_name(symbols[i], &len, &suffix);
+
+        if (name)
+        {
+            buf_snprintf(ptr, "[%i] %.*s%s\n", depth - i, len, name, suffix);
+        }
+    }
+
+    free(symbols);
+}
+
+
+// read a small procfs file, returns zero on failure
+static ssize_t proc_read(const char *path, char *buf, const size_t len)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    const ssize_t amt = read(fd, buf, len - 1);
+    close(fd);
+
+    if (amt < 0)
+    {
+        return 0;
+    }
+
+    buf[amt] = 0;
+    return amt;
+}
 
-        buf_snprintf(ptr, "[%i] %.*s%s\n",
-                     depth - i, name_len, name_str, suffix);
+
+// kB value of a "Key:   123 kB" line, zero if missing
+static uint64_t proc_field(const char *buf, const char *key)
+{
+    const char *it = strstr(buf, key);
+    if (it == NULL)
+    {
+        return 0;
+    }
+
+    return strtoull(it + strlen(key), NULL, 10);
+}
+
+
+/*
+ *  memory breakdown from /proc, all in kB; malloc statistics
+ *  take arena locks, the crash handler has to leave them out
+ */
+static void buf_memory(udbg_buf *ptr, char *scratch, const size_t len, const int with_malloc)
+{
+    if (proc_read("/proc/self/status", scratch, len))
+    {
+        buf_snprintf(ptr, "%8s  rss %llu kB hwm %llu kB vm %llu kB swap %llu kB\n"
+                          "%8s  anon %llu kB file %llu kB shmem %llu kB hugetlb %llu kB\n",
+                     "",
+                     (unsigned long long) proc_field(scratch, "VmRSS:"),
+                     (unsigned long long) proc_field(scratch, "VmHWM:"),
+                     (unsigned long long) proc_field(scratch, "VmSize:"),
+                     (unsigned long long) proc_field(scratch, "VmSwap:"),
+                     "",
+                     (unsigned long long) proc_field(scratch, "RssAnon:"),
+                     (unsigned long long) proc_field(scratch, "RssFile:"),
+                     (unsigned long long) proc_field(scratch, "RssShmem:"),
+                     (unsigned long long) proc_field(scratch, "HugetlbPages:"));
+    }
+
+    if (proc_read("/proc/self/smaps_rollup", scratch, len))
+    {
+        buf_snprintf(ptr, "%8s  pss %llu kB anon thp %llu kB locked %llu kB\n", "",
+                     (unsigned long long) proc_field(scratch, "Pss:"),
+                     (unsigned long long) proc_field(scratch, "AnonHugePages:"),
+                     (unsigned long long) proc_field(scratch, "Locked:"));
+    }
+
+    if (with_malloc)
+    {
+        const struct mallinfo2 info = mallinfo2();
+        const size_t heap = info.arena ? : 1;
+
+        buf_snprintf(ptr, "%8s  heap %zu kB in use %zu kB free %zu kB (%zu%%) mmapped %zu kB\n", "",
+                     info.arena / 1024, info.uordblks / 1024, info.fordblks / 1024,
+                     info.fordblks * 100 / heap, info.hblkhd / 1024);
     }
 }
 
 
 // remap SIGABRT to its default action and abort() if needed
-static void exit_stub()
+__attribute__((noreturn)) static void exit_stub()
 {
-    if (is_set(state.options, UDBG_CORE))
+    if (is_set(state.main.options, UDBG_CORE))
     {
         struct sigaction def_action = {0};
         def_action.sa_sigaction = (void *) SIG_DFL; // !
@@ -304,7 +720,7 @@ static void exit_stub()
  *  try locking the state
  *  wait 5 seconds then panic
  */
-static struct timespec state_lock()
+static struct timespec instance_lock(udbg_instance *h)
 {
     struct timespec delay = {0};
     if (clock_gettime(CLOCK_REALTIME, &delay))
@@ -318,7 +734,18 @@ static struct timespec state_lock()
     struct timespec now = delay;
     delay.tv_sec += 5;
 
-    switch (pthread_mutex_timedlock(&state.lock, &delay))
+    if (pthread_mutex_trylock(&h->lock) == 0)
+    {
+        return now;
+    }
+
+    // waiting may sleep in the kernel
+    if (state.rt.ring)
+    {
+        __atomic_fetch_add(&state.rt.contended, 1, __ATOMIC_RELAXED);
+    }
+
+    switch (pthread_mutex_timedlock(&h->lock, &delay))
     {
         case 0: // success
         {
@@ -341,343 +768,4678 @@ static struct timespec state_lock()
 }
 
 
-static void state_unlock()
+static void instance_unlock(udbg_instance *h)
 {
     // no errors expected here
-    if (pthread_mutex_unlock(&state.lock))
+    if (pthread_mutex_unlock(&h->lock))
     {
         panic("pthread_mutex_unlock()");
     }
 }
 
 
-/*
- *
- */
-void __udbg_sig_handler(const int sig, siginfo_t *siginfo, void *ctx)
+static struct timespec state_lock()
 {
-    // this is not used, so suppress
-    // compilation warnings
-    (void) ctx;
+    return instance_lock(&state.main);
+}
+
+
+static void state_unlock()
+{
+    instance_unlock(&state.main);
+}
 
-    // https://man7.org/linux/man-pages/man3/backtrace.3.html
-    // +do it here so handler is at the top
-    const int depth = backtrace(state.trace, UDBG_CALLSTACK);
 
-    if (is_set(state.options, UDBG_TIME))
+// caller holds the lock; whole records only
+static void early_append(const udbg_buf *ptr)
+{
+    if (state.early_len + ptr->iterator > UDBG_EARLY)
     {
-        struct timespec timestamp = {0};
-        if (clock_gettime(CLOCK_REALTIME, &timestamp))
-        {
-            panic("clock_gettime()");
-        }
+        state.early_dropped++;
+        return;
+    }
 
-        buf_timestamp(0xff, &timestamp, &state.buf_backtrace);
+    memcpy(state.early + state.early_len, ptr->buf, ptr->iterator);
+    state.early_len += ptr->iterator;
+}
+
+
+// caller holds the lock, or is about to terminate
+static void early_drain(const int fd)
+{
+    if (state.early_len && write(fd, state.early, state.early_len) == -1)
+    {
+        panic(STDERR_FILENO, "write()");
     }
 
-    buf_snprintf(&state.buf_backtrace, "[udbg::%s] %s\n\n",
-                 sigabbrev_np(sig),
-                 strerrorname_np(siginfo->si_errno) ? : "unknown_errno");
+    if (state.early_dropped)
+    {
+        dprintf(fd, "[udbg::early] %d records dropped\n", state.early_dropped);
+    }
+
+    state.early_len = 0;
+    state.early_dropped = 0;
+}
 
-    buf_backtrace(&state.buf_backtrace, depth);
 
-    buf_flush(state.fd, &state.buf_backtrace);
-    exit_stub();
+// over RLIMIT_MEMLOCK the pages stay pageable, counted
+static void rt_lock(const void *addr, const size_t len)
+{
+    if (mlock(addr, len))
+    {
+        __atomic_fetch_add(&state.rt.unlocked, len, __ATOMIC_RELAXED);
+    }
 }
 
 
-/*
- *
- */
-void __udbg_init(void *demangler, const char *path,
-                 const int opt, const uint64_t channels)
+// caller holds the lock; copy a record into the ring if it fits, else drop it
+static void rt_push(const udbg_buf *ptr)
 {
-    state.fd = STDERR_FILENO;
-    state.options = opt;
-    // enable everything by default
-    state.channels_mask = channels ? : ((uint64_t) (-1));
-    state.buf_demangle = NULL;
-    state.demangler = demangler;
+    const uint64_t tail = __atomic_load_n(&state.rt.tail, __ATOMIC_ACQUIRE);
+    const uint64_t head = state.rt.head;
 
-    if (pthread_mutex_init(&state.lock, NULL))
+    if (head - tail + ptr->iterator > UDBG_RT_RING)
     {
-        panic(STDERR_FILENO, "pthread_mutex_init()");
+        __atomic_fetch_add(&state.rt.ring_full, 1, __ATOMIC_RELAXED);
+        return;
     }
 
-    // set signals and alternate stack
-    if (!is_set(opt, UDBG_NOSIG))
+    const uint64_t offset = head & (UDBG_RT_RING - 1);
+    const uint64_t first = UDBG_RT_RING - offset < (uint64_t) ptr->iterator ?
+                           UDBG_RT_RING - offset : (uint64_t) ptr->iterator;
+
+    memcpy(state.rt.ring + offset, ptr->buf, first);
+    memcpy(state.rt.ring, ptr->buf + first, ptr->iterator - first);
+
+    __atomic_store_n(&state.rt.head, head + ptr->iterator, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  one drainer at a time, or two would write the same bytes
+ *  and move tail back. a final drain (exit, crash) stops the
+ *  flusher and waits for its round, bounded: a crash in the
+ *  flusher itself must not wait on itself. no locks, it runs
+ *  in signal handlers
+ */
+static int rt_drain_begin(const int final)
+{
+    if (!final)
     {
-        state.alt_stack = malloc(SIGSTKSZ);
-        if (state.alt_stack == NULL)
-        {
-            panic(STDERR_FILENO, "malloc()");
-        }
+        return __atomic_exchange_n(&state.rt.draining, 1, __ATOMIC_ACQUIRE) == 0;
+    }
 
-        const stack_t stack =
-                {
-                        .ss_sp = state.alt_stack,
-                        .ss_flags = 0,
-                        .ss_size = SIGSTKSZ,
-                };
+    __atomic_store_n(&state.rt.stop, 1, __ATOMIC_RELEASE);
 
-        if (sigaltstack(&stack, NULL))
+    for (int i = 0; i < UDBG_RT_WAIT; i++)
+    {
+        if (__atomic_exchange_n(&state.rt.draining, 1, __ATOMIC_ACQUIRE) == 0)
         {
-            panic(STDERR_FILENO, "sigaltstack()");
+            return 1;
         }
 
-        struct sigaction sig_action = {0};
+        const struct timespec delay = {.tv_nsec = 1000000};
+        nanosleep(&delay, NULL);
+    }
+
+    return 0;
+}
+
+
+// write out everything pushed so far
+static void rt_drain(const int final)
+{
+    if (!rt_drain_begin(final))
+    {
+        return;
+    }
+
+    const uint64_t head = __atomic_load_n(&state.rt.head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&state.rt.tail, __ATOMIC_ACQUIRE);
+
+    while (tail != head)
+    {
+        const uint64_t offset = tail & (UDBG_RT_RING - 1);
+        const uint64_t len = head - tail < UDBG_RT_RING - offset ?
+                             head - tail : UDBG_RT_RING - offset;
+
+        const ssize_t amt = write(state.main.fd, state.rt.ring + offset, len);
+        if (amt == -1)
+        {
+            panic(STDERR_FILENO, "write()");
+        }
+
+        tail += amt;
+        __atomic_store_n(&state.rt.tail, tail, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&state.rt.draining, 0, __ATOMIC_RELEASE);
+}
+
+
+// caller holds the lock
+static void instance_flush(udbg_instance *h)
+{
+    if (h == &state.main && !__atomic_load_n(&state.ready, __ATOMIC_ACQUIRE))
+    {
+        early_append(&h->buf_output);
+        h->buf_output.iterator = 0;
+        return;
+    }
+
+    // ring full: dropped, counted; after the final drain written directly
+    if (h == &state.main && state.rt.ring && !__atomic_load_n(&state.rt.stop, __ATOMIC_ACQUIRE))
+    {
+        rt_push(&h->buf_output);
+        h->buf_output.iterator = 0;
+        return;
+    }
+
+    buf_flush(h->fd, &h->buf_output);
+}
+
+
+static void state_flush()
+{
+    instance_flush(&state.main);
+}
+
+
+/*
+ *  udbg_init() never finished, e.g. a library logged but its
+ *  host never set udbg up: the early records go to stderr,
+ *  as they did before there was an early buffer
+ */
+__attribute__((destructor)) static void early_exit()
+{
+    if (__atomic_load_n(&state.ready, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    state_lock();
+
+    if (!state.ready)
+    {
+        early_drain(STDERR_FILENO);
+    }
+
+    state_unlock();
+}
+
+
+/*
+ *  fill the unused part of the calling thread's stack
+ *  with a pattern; everything below the deepest frame
+ *  reached later stays intact
+ */
+__attribute__((noinline)) static void stack_paint(udbg_thread *self)
+{
+    uint8_t *frame = __builtin_frame_address(0);
+    uint8_t *end = frame - UDBG_STACK_MARGIN;
+
+    if (end > self->stack_lo)
+    {
+        memset(self->stack_lo, UDBG_STACK_PATTERN, end - self->stack_lo);
+        self->painted = 1;
+    }
+}
+
+
+// deepest stack usage so far, in bytes
+static size_t stack_used(const udbg_thread *thread)
+{
+    const uint8_t *ptr = thread->stack_lo;
+    while (ptr < thread->stack_hi && *ptr == UDBG_STACK_PATTERN)
+    {
+        ptr++;
+    }
+
+    return thread->stack_hi - ptr;
+}
+
+
+static void buf_stack_usage(udbg_buf *ptr, const udbg_thread *thread)
+{
+    char name[16] = {0};
+    pthread_getname_np(thread->thread, name, sizeof(name));
+
+    const size_t size = thread->stack_hi - thread->stack_lo;
+    const size_t used = stack_used(thread);
+
+    buf_snprintf(ptr, "%8s  %8d %-16s used %zu KiB of %zu KiB (%.1f%%)\n", "",
+                 thread->tid, name, used / 1024, size / 1024, used * 100.0 / size);
+}
+
+
+// log stack usage of the calling thread and take it off the list
+static void thread_unregister(udbg_thread *self)
+{
+    const struct timespec timestamp = state_lock();
+
+    for (udbg_thread **it = &state.threads; *it; it = &(*it)->next)
+    {
+        if (*it == self)
+        {
+            *it = self->next;
+            break;
+        }
+    }
+
+    if (self->painted)
+    {
+        buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+        buf_snprintf(&state.main.buf_output, "[udbg::stack] thread exit\n");
+        buf_stack_usage(&state.main.buf_output, self);
+        state_flush();
+    }
+
+    state_unlock();
+}
+
+
+// perf counters of a thread, slots back to -1
+static void thread_perf_close(udbg_thread *self)
+{
+    for (int i = 0; i < __UDBG_PERF_COUNTERS; i++)
+    {
+        if (self->perf_fd[i] >= 0)
+        {
+            close(self->perf_fd[i]);
+            self->perf_fd[i] = -1;
+        }
+    }
+
+    self->perf_mode = 0;
+}
+
+
+static void thread_release(void *ptr)
+{
+    udbg_thread *self = ptr;
+
+    if (self->tid)
+    {
+        thread_unregister(self);
+    }
+
+    if (self->alt_stack)
+    {
+        const stack_t disable = {.ss_flags = SS_DISABLE};
+        if (sigaltstack(&disable, NULL))
+        {
+            panic("sigaltstack()");
+        }
+
+        munmap(self->alt_stack, self->alt_stack_len);
+    }
+
+    thread_perf_close(self);
+    free(self->rec);
+    free(self);
+    thread_self = NULL;
+}
+
+
+static void thread_key_create()
+{
+    if (pthread_key_create(&thread_key, thread_release))
+    {
+        panic("pthread_key_create()");
+    }
+}
+
+
+// lazily allocate data of the calling thread
+static udbg_thread *thread_get()
+{
+    if (thread_self)
+    {
+        return thread_self;
+    }
+
+    if (pthread_once(&thread_once, thread_key_create))
+    {
+        panic("pthread_once()");
+    }
+
+    udbg_thread *self = calloc(1, sizeof(udbg_thread));
+    if (self == NULL)
+    {
+        panic("calloc()");
+    }
+
+    // udbg_rt() allocated the calling thread's, others allocate here
+    if (state.rt.ring)
+    {
+        __atomic_fetch_add(&state.rt.allocs, 1, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < __UDBG_PERF_COUNTERS; i++)
+    {
+        self->perf_fd[i] = -1;
+    }
+
+    if (pthread_setspecific(thread_key, self))
+    {
+        panic("pthread_setspecific()");
+    }
+
+    thread_self = self;
+    return self;
+}
+
+
+#ifndef UDBG_NO_SIGNALS
+/*
+ *  give the calling thread its own alternate signal stack,
+ *  so a stack overflow can still be reported. guard page
+ *  sits below, the stack grows towards it
+ */
+static void thread_alt_stack(udbg_thread *self)
+{
+    if (self->alt_stack)
+    {
+        return;
+    }
+
+    // SIGSTKSZ is not a constant anymore:
+    // https://sourceware.org/git/?p=glibc.git;a=commitdiff;h=6c57d320484988e87e446e2e60ce42816bf51d53
+    const long page = sysconf(_SC_PAGESIZE);
+    long size = SIGSTKSZ;
+
+#ifdef _SC_SIGSTKSZ
+    const long dynamic = sysconf(_SC_SIGSTKSZ);
+    size = dynamic > 0 ? dynamic : size;
+#endif
+
+    size = (size + page - 1) / page * page;
+
+    uint8_t *base = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        panic("mmap()");
+    }
+
+    if (mprotect(base, page, PROT_NONE))
+    {
+        panic("mprotect()");
+    }
+
+    const stack_t stack =
+            {
+                    .ss_sp = base + page,
+                    .ss_flags = 0,
+                    .ss_size = size,
+            };
+
+    if (sigaltstack(&stack, NULL))
+    {
+        panic("sigaltstack()");
+    }
+
+    // no page faults in the handler either
+    if (state.rt.ring)
+    {
+        rt_lock(base + page, size);
+    }
+
+    self->alt_stack = base;
+    self->alt_stack_len = size + page;
+}
+#endif
+
+
+// put the calling thread on the list, paint its stack if asked to
+static void thread_register(udbg_thread *self)
+{
+    if (self->tid)
+    {
+        return;
+    }
+
+    pthread_attr_t attr;
+    void *addr = NULL;
+    size_t size = 0;
+
+    self->thread = pthread_self();
+    if (pthread_getattr_np(self->thread, &attr) ||
+        pthread_attr_getstack(&attr, &addr, &size))
+    {
+        panic("pthread_getattr_np()");
+    }
+
+    pthread_attr_destroy(&attr);
+
+    self->tid = gettid();
+    self->stack_lo = addr;
+    self->stack_hi = (uint8_t *) addr + size;
+
+    if (is_set(state.main.options, UDBG_STACK_PAINT))
+    {
+        stack_paint(self);
+    }
+
+    state_lock();
+    self->next = state.threads;
+    state.threads = self;
+    state_unlock();
+}
+
+
+void __udbg_thread_attach()
+{
+    udbg_thread *self = thread_get();
+    thread_register(self);
+
+#ifndef UDBG_NO_SIGNALS
+    if (!is_set(state.main.options, UDBG_NOSIG))
+    {
+        thread_alt_stack(self);
+    }
+#endif
+}
+
+
+#ifndef UDBG_NO_SIGNALS
+/*
+ *
+ */
+void __udbg_sig_handler(const int sig, siginfo_t *siginfo, void *ctx)
+{
+    // this is not used, so suppress
+    // compilation warnings
+    (void) ctx;
+
+    // https://man7.org/linux/man-pages/man3/backtrace.3.html
+    // +do it here so handler is at the top
+    const int depth = backtrace(state.trace, UDBG_CALLSTACK);
+
+    if (is_set(state.main.options, UDBG_TIME))
+    {
+        struct timespec timestamp = {0};
+        if (clock_gettime(CLOCK_REALTIME, &timestamp))
+        {
+            panic("clock_gettime()");
+        }
+
+        buf_timestamp(0xff, &timestamp, &state.buf_backtrace);
+    }
+
+    buf_snprintf(&state.buf_backtrace, "[udbg::%s] %s\n\n",
+                 sigabbrev_np(sig),
+                 strerrorname_np(siginfo->si_errno) ? : "unknown_errno");
+
+    buf_backtrace(&state.buf_backtrace, state.trace, depth);
+
+    buf_snprintf(&state.buf_backtrace, "\n[udbg::mem]\n");
+    buf_memory(&state.buf_backtrace, state.crash_scratch, sizeof(state.crash_scratch), 0);
+
+    if (!__atomic_load_n(&state.ready, __ATOMIC_ACQUIRE))
+    {
+        early_drain(state.main.fd);
+    }
+
+    if (state.rt.ring)
+    {
+        rt_drain(1);
+    }
+
+    buf_flush(state.main.fd, &state.buf_backtrace);
+    exit_stub();
+}
+#endif
+
+
+// everything enabled unless channels are given
+static void instance_setup(udbg_instance *h, const int opt, const uint64_t channels)
+{
+    h->options = opt;
+    // enable everything by default
+    h->channels_mask = channels ? : ((uint64_t) (-1));
+}
+
+
+// returns the log file, STDERR without a path, -1 if it can't be opened
+static int instance_open_file(const int opt, const char *path)
+{
+    int fd = STDERR_FILENO;
+
+    // open the log file
+    if (path)
+    {
+        // and if the suffix attr is set,
+        // get current time and form a full path
+        char full_path[PATH_MAX + 1] = {0};
+        const char *path_ptr = path;
+        if (is_set(opt, UDBG_SUFFIX))
+        {
+            char time_str[32] = {0};
+            struct timespec time = {0};
+            if (clock_gettime(CLOCK_REALTIME, &time))
+            {
+                panic(STDERR_FILENO, "clock_gettime()");
+            }
+
+            const struct tm *ts = localtime(&time.tv_sec);
+            if (ts == NULL)
+            {
+                panic(STDERR_FILENO, "localtime()");
+            }
+
+            if (strftime(time_str, 32, "%F_%X", ts) != 19)
+            {
+                panic(STDERR_FILENO, "strftime()");
+            }
+
+            const int amt = snprintf(full_path, sizeof(full_path), "%s_%s.log",
+                                     path, time_str);
+            if (amt == -1)
+            {
+                panic(STDERR_FILENO, "snprint()");
+            }
+
+            // path can become too long after appending suffix
+            if (amt > PATH_MAX)
+            {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+
+            path_ptr = full_path;
+        }
+
+        // finally open the file
+        int fd_opt = O_WRONLY | O_CREAT | O_APPEND;
+        if (opt & UDBG_TRUNCATE)
+        {
+            fd_opt |= O_TRUNC;
+        }
+
+        fd = open(path_ptr, fd_opt, 0600);
+    }
+
+    return fd;
+}
+
+
+/*
+ *  the slow part of initialization: files, buffers
+ *  and libgcc for backtrace(); replays the early
+ *  buffer once done
+ */
+static void init_deferred(const char *path)
+{
+    const int fd = instance_open_file(state.main.options, path);
+    if (fd < 0)
+    {
+        panic(STDERR_FILENO, "open()");
+    }
+
+    char *path_copy = NULL;
+    if (path)
+    {
+        path_copy = strdup(path);
+        if (path_copy == NULL)
+        {
+            panic(STDERR_FILENO, "strdup()");
+        }
+    }
+
+    void *preload[1];
+    backtrace(preload, 1);
+
+    // all at once: fork() holds the lock, a child sees none or all of it
+    state_lock();
+
+    state.main.fd = fd;
+    state.path = path_copy;
+    early_drain(fd);
+    __atomic_store_n(&state.ready, 1, __ATOMIC_RELEASE);
+
+    state_unlock();
+}
+
+
+// exiting before the background part is done would lose the early records
+static void init_exit()
+{
+    for (int i = 0; i < 1000 && !__atomic_load_n(&state.ready, __ATOMIC_ACQUIRE); i++)
+    {
+        const struct timespec delay = {.tv_nsec = 1000000};
+        nanosleep(&delay, NULL);
+    }
+}
+
+
+static void *init_thread(void *arg)
+{
+    (void) arg;
+    init_deferred(state.lazy_path);
+
+    return NULL;
+}
+
+
+// the background part of a lazy udbg_init()
+static void init_start()
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic(STDERR_FILENO, "pthread_attr_init()");
+    }
+
+    if (pthread_create(&thread, &attr, init_thread, NULL))
+    {
+        panic(STDERR_FILENO, "pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-init");
+}
+
+
+/*
+ *
+ */
+void __udbg_init(void *demangler, const char *path,
+                 const int opt, const uint64_t channels)
+{
+    // already set up, e.g. from the environment
+    if (__atomic_exchange_n(&state.initialized, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+
+    state.buf_demangle = NULL;
+#ifdef UDBG_NO_DEMANGLE
+    (void) demangler;
+#else
+    state.demangler = demangler;
+
+    // here, not in the background: frame_name() grows it under the lock
+    if (demangler)
+    {
+        state.buf_demangle = malloc(UDBG_BUF);
+        if (state.buf_demangle == NULL)
+        {
+            panic(STDERR_FILENO, "malloc()");
+        }
+
+        state.buf_demangle_len = UDBG_BUF;
+    }
+#endif
+
+    instance_setup(&state.main, opt, channels);
+
+    // set signals and alternate stack
+#ifndef UDBG_NO_SIGNALS
+    if (!is_set(opt, UDBG_NOSIG))
+    {
+        // other threads get theirs with udbg_thread_attach()
+        thread_alt_stack(thread_get());
+
+        struct sigaction sig_action = {0};
         sigset_t block_set = {0};
 
-        if (sigemptyset(&block_set))
+        if (sigemptyset(&block_set))
+        {
+            panic(STDERR_FILENO, "sigemptyset()");
+        }
+
+        // sa_mask specifies a mask of signals which should be blocked
+        // (i.e., added to the signal mask of the thread in which the signal
+        // handler is invoked) during execution of the signal handler
+        for (unsigned long i = 0; i < sizeof(udbg_signals) / sizeof(int); i++)
+        {
+            if (sigaddset(&block_set, udbg_signals[i]))
+            {
+                panic(STDERR_FILENO, "sigaddset()");
+            }
+        }
+
+        // deliver signal info
+        // execute handler on alternate stack
+        // reset to default action on entry
+        sig_action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+        sig_action.sa_mask = block_set;
+        sig_action.sa_sigaction = __udbg_sig_handler;
+
+        for (unsigned long i = 0; i < sizeof(udbg_signals) / sizeof(int); i++)
+        {
+            if (sigaction(udbg_signals[i], &sig_action, NULL))
+            {
+                // let this also indicate which signal caused a failure
+                panic(STDERR_FILENO, sigabbrev_np(udbg_signals[i]));
+            }
+        }
+    }
+#endif
+
+    if (is_set(opt, UDBG_STACK_PAINT))
+    {
+        thread_register(thread_get());
+    }
+
+    if (!is_set(opt, UDBG_LAZY))
+    {
+        init_deferred(path);
+        return;
+    }
+
+    if (path)
+    {
+        state.lazy_path = strdup(path);
+        if (state.lazy_path == NULL)
+        {
+            panic(STDERR_FILENO, "strdup()");
+        }
+    }
+
+    if (atexit(init_exit))
+    {
+        panic(STDERR_FILENO, "atexit()");
+    }
+
+    init_start();
+}
+
+
+void __udbg_throwfmt(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    const struct timespec timestamp = state_lock(); // no return => no unlock
+
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+    buf_vaprintf(&state.main.buf_output, fmt, args);
+
+    va_end(args);
+
+    const int depth = backtrace(state.trace, UDBG_CALLSTACK);
+    buf_backtrace(&state.main.buf_output, state.trace, depth);
+
+    // terminating, nothing gets replayed later
+    if (!__atomic_load_n(&state.ready, __ATOMIC_ACQUIRE))
+    {
+        early_drain(state.main.fd);
+    }
+
+    if (state.rt.ring)
+    {
+        rt_drain(1);
+    }
+
+    buf_flush(state.main.fd, &state.main.buf_output);
+    exit_stub();
+}
+
+
+void __udbg_assert_fail(const __udbg_site *site)
+{
+    __udbg_throwfmt("[udbg::%s] %s\n%s() %s:%u\n", site->kind,
+                    site->expr, site->function, site->file, site->line);
+}
+
+
+static void value_format(char *buf, const size_t len, const __udbg_value *value)
+{
+    switch (value->type)
+    {
+        case __UDBG_VALUE_I:
+            snprintf(buf, len, "%" PRId64, value->i);
+            break;
+
+        case __UDBG_VALUE_U:
+            snprintf(buf, len, "%" PRIu64, value->u);
+            break;
+
+        case __UDBG_VALUE_F:
+            snprintf(buf, len, "%.17g", value->f);
+            break;
+
+        case __UDBG_VALUE_NONE:
+            snprintf(buf, len, "(not printable)");
+            break;
+
+        default:
+            snprintf(buf, len, "%p", (const void *) value->p);
+    }
+}
+
+
+void __udbg_assert_cmp_fail(const __udbg_site *site,
+                            const __udbg_value a, const __udbg_value b)
+{
+    char left[32] = {0};
+    char right[32] = {0};
+
+    value_format(left, sizeof(left), &a);
+    value_format(right, sizeof(right), &b);
+
+    __udbg_throwfmt("[udbg::%s] %s\n%8s  %s vs %s\n%s() %s:%u\n",
+                    site->kind, site->expr, "", left, right,
+                    site->function, site->file, site->line);
+}
+
+
+static void instance_log(udbg_instance *h, const char *fmt, va_list args)
+{
+    const struct timespec timestamp = instance_lock(h);
+
+    buf_timestamp(h->options, &timestamp, &h->buf_output);
+    buf_vaprintf(&h->buf_output, fmt, args);
+
+    instance_flush(h);
+    instance_unlock(h);
+}
+
+
+void __udbg_log(const uint64_t channel, const char *fmt, ...)
+{
+    if (!channel_on(&state.main, channel))
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+
+    instance_log(&state.main, fmt, args);
+    va_end(args);
+}
+
+
+void __udbg_log_h(udbg_t *h, const uint64_t channel, const char *fmt, ...)
+{
+    if (h == NULL || !channel_on(h, channel))
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+
+    instance_log(h, fmt, args);
+    va_end(args);
+}
+
+
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+udbg_t *__udbg_open(const char *path, const int opt, const uint64_t channels)
+{
+    udbg_instance *h = calloc(1, sizeof(udbg_instance));
+    if (h == NULL)
+    {
+        panic("calloc()");
+    }
+
+    if (pthread_mutex_init(&h->lock, NULL))
+    {
+        panic("pthread_mutex_init()");
+    }
+
+    instance_setup(h, opt, channels);
+    h->fd = instance_open_file(opt, path);
+
+    // a bad path is the caller's to handle
+    if (h->fd < 0)
+    {
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&handles_lock);
+    h->next = state.handles;
+    state.handles = h;
+    pthread_mutex_unlock(&handles_lock);
+
+    return h;
+}
+
+
+void __udbg_close(udbg_t *h)
+{
+    if (h == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&handles_lock);
+    for (udbg_instance **it = &state.handles; *it; it = &(*it)->next)
+    {
+        if (*it == h)
+        {
+            *it = h->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handles_lock);
+
+    if (h->fd != STDERR_FILENO)
+    {
+        close(h->fd);
+    }
+
+    if (pthread_mutex_destroy(&h->lock))
+    {
+        panic("pthread_mutex_destroy()");
+    }
+
+    free(h);
+}
+
+
+///////////////////////////////
+///     hex & bin dumps     ///
+///////////////////////////////
+
+#ifndef UDBG_NO_HEXDUMP
+// decide if this char is printable
+static inline char asc_output(const uint8_t ch)
+{
+    if (ch > 0x1f && ch < 0x7f)
+    {
+        return (char) ch;
+    }
+
+    return '.';
+}
+
+// convert a byte to printable form
+static inline void hex_converter(const uint8_t input, char *output)
+{
+    const char hex[] = "0123456789abcdef";
+
+    output[0] = hex[input >> 4];
+    output[1] = hex[input & 0xf];
+    output[2] = ' ';
+}
+
+
+/*
+ *  append rows of a hex dump to output buffer;
+ *  offsets are printed starting at base
+ */
+static void buf_hexdump(udbg_buf *ptr, const uint8_t *data,
+                        const int len, const int base)
+{
+    const uint8_t *data_end = data + len;
+
+    for (int i = 0; i < len; i += 16)
+    {
+        char ascii[32] = {0};
+        char left[32] = {0};
+        char right[32] = {0};
+        const uint8_t *row = data + i;
+        int asc_offset = 0;
+
+        for (int j = 0; j < 24 && row != data_end; j += 3)
+        {
+            hex_converter(*row, left + j);
+            ascii[asc_offset++] = asc_output(*row);
+            row += 1;
+        }
+
+        for (int j = 0; j < 24 && row != data_end; j += 3)
+        {
+            hex_converter(*row, right + j);
+            ascii[asc_offset++] = asc_output(*row);
+            row += 1;
+        }
+
+        buf_snprintf(ptr, "%8d  %-24s %-24s |%-16s|\n",
+                     base + i, left, right, ascii);
+    }
+}
+#endif
+
+
+/*
+ *  xxh64; four independent lanes over 32 byte stripes. xxh3
+ *  is faster only past a few hundred bytes, where its simd
+ *  stripes pay off; inputs here are mostly call stacks and
+ *  small buffers, and xxh3 would add a 192 byte secret and
+ *  four size-specific paths to the footprint build. logged
+ *  fingerprints also stay comparable with earlier logs
+ */
+#define XXH_P1 0x9e3779b185ebca87ull
+#define XXH_P2 0xc2b2ae3d27d4eb4full
+#define XXH_P3 0x165667b19e3779f9ull
+#define XXH_P4 0x85ebca77c2b2ae63ull
+#define XXH_P5 0x27d4eb2f165667c5ull
+
+static inline uint64_t xxh_rotl(const uint64_t x, const int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, const uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, const uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const uint8_t *data, const size_t len)
+{
+    const uint8_t *end = data + len;
+    uint64_t h = 0;
+
+    if (len >= 32)
+    {
+        uint64_t v[4] = {XXH_P1 + XXH_P2, XXH_P2, 0, -XXH_P1};
+
+        for (; data + 32 <= end; data += 32)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                v[i] = xxh_round(v[i], xxh_read64(data + i * 8));
+            }
+        }
+
+        h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) +
+            xxh_rotl(v[2], 12) + xxh_rotl(v[3], 18);
+
+        for (int i = 0; i < 4; i++)
+        {
+            h = xxh_merge(h, v[i]);
+        }
+    }
+    else
+    {
+        h = XXH_P5;
+    }
+
+    h += len;
+
+    for (; data + 8 <= end; data += 8)
+    {
+        h ^= xxh_round(0, xxh_read64(data));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+
+    if (data + 4 <= end)
+    {
+        uint32_t v = 0;
+        memcpy(&v, data, sizeof(v));
+
+        h ^= (uint64_t) v * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        data += 4;
+    }
+
+    for (; data < end; data++)
+    {
+        h ^= (*data) * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+/*
+ *  remember a hash; returns non-zero if it was
+ *  seen before. a full table counts as seen,
+ *  that way output stays bounded
+ */
+static int hash_seen(uint64_t *table, const int size, const uint64_t hash)
+{
+    const uint64_t key = hash ? : 1;
+
+    for (int i = 0; i < size; i++)
+    {
+        uint64_t *slot = &table[(key + i) & (size - 1)];
+        if (*slot == key)
+        {
+            return 1;
+        }
+
+        if (*slot == 0)
+        {
+            *slot = key;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+#ifndef UDBG_NO_HEXDUMP
+// caller holds the lock
+static void fingerprint(udbg_instance *h, const char *prefix, const uint8_t *data, const int len)
+{
+    // nothing to hash, as a hex dump would show no rows
+    if (len < 0)
+    {
+        buf_snprintf(&h->buf_output, "%s\n%8s  len %d\n", prefix, "", len);
+        return;
+    }
+
+    const uint64_t hash = xxh64(data, len);
+
+    buf_snprintf(&h->buf_output, "%s\n%8s  len %d xxh64 %016llx\n",
+                 prefix, "", len, (unsigned long long) hash);
+
+    if (is_set(h->options, UDBG_FP_FIRST) && !hash_seen(h->fp_seen, UDBG_FP_SEEN, hash))
+    {
+        buf_hexdump(&h->buf_output, data, len, 0);
+        return;
+    }
+
+    if (len <= UDBG_FP_SAMPLE * 2)
+    {
+        buf_hexdump(&h->buf_output, data, len, 0);
+        return;
+    }
+
+    const int tail = len - UDBG_FP_SAMPLE;
+
+    buf_hexdump(&h->buf_output, data, UDBG_FP_SAMPLE, 0);
+    buf_snprintf(&h->buf_output, "%8s  ..\n", "");
+    buf_hexdump(&h->buf_output, data + tail, UDBG_FP_SAMPLE, tail);
+}
+
+
+static void instance_hexdump(udbg_instance *h, const uint64_t channel,
+                             const char *prefix, const void *ptr, const int len)
+{
+    if (!channel_on(h, channel))
+    {
+        return;
+    }
+
+    const struct timespec timestamp = instance_lock(h);
+    buf_timestamp(h->options, &timestamp, &h->buf_output);
+
+    if (is_set(h->options, UDBG_FINGERPRINT))
+    {
+        fingerprint(h, prefix, ptr, len);
+    }
+    else
+    {
+        buf_snprintf(&h->buf_output, "%s\n", prefix);
+        buf_hexdump(&h->buf_output, ptr, len, 0);
+    }
+
+    instance_flush(h);
+    instance_unlock(h);
+}
+
+
+void __udbg_hexdump(const uint64_t channel, const char *prefix,
+                    const void *ptr, const int len)
+{
+    instance_hexdump(&state.main, channel, prefix, ptr, len);
+}
+
+
+void __udbg_hexdump_h(udbg_t *h, const uint64_t channel, const char *prefix,
+                      const void *ptr, const int len)
+{
+    if (h)
+    {
+        instance_hexdump(h, channel, prefix, ptr, len);
+    }
+}
+
+
+static void instance_fingerprint(udbg_instance *h, const uint64_t channel,
+                                 const char *prefix, const void *ptr, const int len)
+{
+    if (!channel_on(h, channel))
+    {
+        return;
+    }
+
+    const struct timespec timestamp = instance_lock(h);
+    buf_timestamp(h->options, &timestamp, &h->buf_output);
+
+    fingerprint(h, prefix, ptr, len);
+
+    instance_flush(h);
+    instance_unlock(h);
+}
+
+
+void __udbg_fingerprint(const uint64_t channel, const char *prefix,
+                        const void *ptr, const int len)
+{
+    instance_fingerprint(&state.main, channel, prefix, ptr, len);
+}
+
+
+void __udbg_fingerprint_h(udbg_t *h, const uint64_t channel, const char *prefix,
+                          const void *ptr, const int len)
+{
+    if (h)
+    {
+        instance_fingerprint(h, channel, prefix, ptr, len);
+    }
+}
+#endif
+
+
+#ifndef UDBG_NO_BINDUMP
+static void instance_bindump(udbg_instance *h, const uint64_t channel,
+                             const char *prefix, const void *ptr, const int len)
+{
+    if (!channel_on(h, channel))
+    {
+        return;
+    }
+
+    const struct timespec timestamp = instance_lock(h);
+    const uint8_t *data = (uint8_t *) ptr;
+
+    buf_timestamp(h->options, &timestamp, &h->buf_output);
+    buf_snprintf(&h->buf_output, "%s\n", prefix);
+
+    for (int i = 0; i < len; i += 8)
+    {
+        char decoded_row[72] = {0};
+        int iterator = 0;
+
+        for (int j = 0; j < 8 && j + i < len; j++)
+        {
+            const uint8_t byte = data[i + j];
+
+            for (char k = 7; k >= 0; k--)
+            {
+                const char symbol = (byte & (1 << k)) ? '1' : '0';
+                decoded_row[iterator++] = symbol;
+            }
+
+            decoded_row[iterator++] = ' ';
+        }
+
+        buf_snprintf(&h->buf_output, "%8d  %s\n", i, decoded_row);
+    }
+
+    instance_flush(h);
+    instance_unlock(h);
+}
+
+
+void __udbg_bindump(const uint64_t channel, const char *prefix,
+                    const void *ptr, const int len)
+{
+    instance_bindump(&state.main, channel, prefix, ptr, len);
+}
+
+
+void __udbg_bindump_h(udbg_t *h, const uint64_t channel, const char *prefix,
+                      const void *ptr, const int len)
+{
+    if (h)
+    {
+        instance_bindump(h, channel, prefix, ptr, len);
+    }
+}
+#endif
+
+
+///////////////////////
+///     records     ///
+///////////////////////
+
+// the record buffer of a thread, allocated on first use
+static udbg_rec_t *thread_rec(udbg_thread *self)
+{
+    if (self->rec)
+    {
+        return self->rec;
+    }
+
+    self->rec = malloc(sizeof(udbg_rec_t));
+    if (self->rec == NULL)
+    {
+        panic("malloc()");
+    }
+
+    if (state.rt.ring)
+    {
+        __atomic_fetch_add(&state.rt.allocs, 1, __ATOMIC_RELAXED);
+    }
+
+    return self->rec;
+}
+
+
+/*
+ *  start a record in the per-thread buffer;
+ *  NULL if the channel is disabled
+ */
+udbg_rec_t *__udbg_rec_begin(const uint64_t channel, const char *fmt, ...)
+{
+    if (!channel_on(&state.main, channel))
+    {
+        return NULL;
+    }
+
+    udbg_rec_t *rec = thread_rec(thread_get());
+    rec->lines = 0;
+    rec->buf.iterator = 0;
+
+    struct timespec timestamp = {0};
+    if (clock_gettime(CLOCK_REALTIME, &timestamp))
+    {
+        panic("clock_gettime()");
+    }
+
+    buf_timestamp(state.main.options, &timestamp, &rec->buf);
+
+    va_list args;
+    va_start(args, fmt);
+
+    buf_vaprintf(&rec->buf, fmt, args);
+    va_end(args);
+
+    return rec;
+}
+
+
+// first line goes right after the prefix, the rest are indented
+void __udbg_rec_append(udbg_rec_t *rec, const char *fmt, ...)
+{
+    if (rec == NULL)
+    {
+        return;
+    }
+
+    if (rec->lines)
+    {
+        buf_snprintf(&rec->buf, "%8s  ", "");
+    }
+
+    va_list args;
+    va_start(args, fmt);
+
+    buf_vaprintf(&rec->buf, fmt, args);
+    va_end(args);
+
+    rec->lines++;
+}
+
+
+#ifndef UDBG_NO_HEXDUMP
+void __udbg_rec_hexdump(udbg_rec_t *rec, const char *prefix,
+                        const void *ptr, const int len)
+{
+    if (rec == NULL)
+    {
+        return;
+    }
+
+    // label completes an empty prefix line
+    if (rec->lines)
+    {
+        buf_snprintf(&rec->buf, "%8s  %s\n", "", prefix);
+    }
+    else
+    {
+        buf_snprintf(&rec->buf, "%s\n", prefix);
+    }
+
+    buf_hexdump(&rec->buf, ptr, len, 0);
+
+    rec->lines++;
+}
+#endif
+
+
+// one lock, one write, nothing interleaved
+void __udbg_rec_commit(udbg_rec_t *rec)
+{
+    if (rec == NULL)
+    {
+        return;
+    }
+
+    // nothing appended: the prefix line is still open
+    if (rec->lines == 0)
+    {
+        buf_snprintf(&rec->buf, "\n");
+    }
+
+    udbg_instance *h = &state.main;
+    instance_lock(h);
+
+    // output buffer is empty between records
+    memcpy(h->buf_output.buf, rec->buf.buf, rec->buf.iterator + 1);
+    h->buf_output.iterator = rec->buf.iterator;
+
+    instance_flush(h);
+    instance_unlock(h);
+
+    rec->buf.iterator = 0;
+}
+
+
+///////////////////////////
+///     array dumps     ///
+///////////////////////////
+
+typedef struct
+{
+    double min;
+    double max;
+    double sum;
+
+    int finite;
+    int nan;
+    int inf;
+    int first_bad;
+
+} array_summary;
+
+#define ARRAY_LANES         8                   // independent accumulators
+
+/*
+ *  min, max and sum of all elements, kept in lanes so no
+ *  step depends on the one before and the inner loop
+ *  vectorizes without -ffast-math; lanes are folded at the
+ *  end. sums of 32 bit integers are exact
+ */
+#define array_lanes(name_, type_, sum_type_)                        \
+static void name_(const type_ *v, const int n, array_summary *s)    \
+{                                                                   \
+    type_ lo[ARRAY_LANES];                                          \
+    type_ hi[ARRAY_LANES];                                          \
+    sum_type_ sum[ARRAY_LANES] = {0};                               \
+                                                                    \
+    for (int j = 0; j < ARRAY_LANES; j++)                           \
+    {                                                               \
+        lo[j] = v[0];                                               \
+        hi[j] = v[0];                                               \
+    }                                                               \
+                                                                    \
+    int i = 0;                                                      \
+    for (; i + ARRAY_LANES <= n; i += ARRAY_LANES)                  \
+    {                                                               \
+        for (int j = 0; j < ARRAY_LANES; j++)                       \
+        {                                                           \
+            lo[j] = v[i + j] < lo[j] ? v[i + j] : lo[j];            \
+            hi[j] = v[i + j] > hi[j] ? v[i + j] : hi[j];            \
+            sum[j] += (sum_type_) v[i + j];                         \
+        }                                                           \
+    }                                                               \
+                                                                    \
+    for (; i < n; i++)                                              \
+    {                                                               \
+        lo[0] = v[i] < lo[0] ? v[i] : lo[0];                        \
+        hi[0] = v[i] > hi[0] ? v[i] : hi[0];                        \
+        sum[0] += (sum_type_) v[i];                                 \
+    }                                                               \
+                                                                    \
+    for (int j = 1; j < ARRAY_LANES; j++)                           \
+    {                                                               \
+        lo[0] = lo[j] < lo[0] ? lo[j] : lo[0];                      \
+        hi[0] = hi[j] > hi[0] ? hi[j] : hi[0];                      \
+        sum[0] += sum[j];                                           \
+    }                                                               \
+                                                                    \
+    s->min = (double) lo[0];                                        \
+    s->max = (double) hi[0];                                        \
+    s->sum = (double) sum[0];                                       \
+    s->finite = n;                                                  \
+}
+
+array_lanes(lanes_f32, float, double)
+array_lanes(lanes_f64, double, double)
+array_lanes(summary_i32, int32_t, int64_t)
+array_lanes(summary_i64, int64_t, double)
+array_lanes(summary_u32, uint32_t, uint64_t)
+array_lanes(summary_u64, uint64_t, double)
+
+/*
+ *  first pass only counts non-finite values (x - x != 0 for
+ *  both nan and inf) and stays branch free; the common all
+ *  finite case then runs the same lanes as integers do
+ */
+#define array_summary_float(name_, type_, lanes_)                   \
+static void name_(const type_ *v, const int n, array_summary *s)    \
+{                                                                   \
+    int bad = 0;                                                    \
+    for (int i = 0; i < n; i++)                                     \
+    {                                                               \
+        bad += (v[i] - v[i] != 0);                                  \
+    }                                                               \
+                                                                    \
+    if (bad == 0)                                                   \
+    {                                                               \
+        lanes_(v, n, s);                                            \
+        return;                                                     \
+    }                                                               \
+                                                                    \
+    type_ lo = 0;                                                   \
+    type_ hi = 0;                                                   \
+    double sum = 0;                                                 \
+    int first = 1;                                                  \
+                                                                    \
+    for (int i = 0; i < n; i++)                                     \
+    {                                                               \
+        if (v[i] - v[i] != 0)                                       \
+        {                                                           \
+            if (v[i] != v[i])                                       \
+            {                                                       \
+                s->nan++;                                           \
+            }                                                       \
+            else                                                    \
+            {                                                       \
+                s->inf++;                                           \
+            }                                                       \
+                                                                    \
+            if (s->first_bad == -1)                                 \
+            {                                                       \
+                s->first_bad = i;                                   \
+            }                                                       \
+                                                                    \
+            continue;                                               \
+        }                                                           \
+                                                                    \
+        if (first)                                                  \
+        {                                                           \
+            lo = v[i];                                              \
+            hi = v[i];                                              \
+            first = 0;                                              \
+        }                                                           \
+                                                                    \
+        lo = v[i] < lo ? v[i] : lo;                                 \
+        hi = v[i] > hi ? v[i] : hi;                                 \
+        sum += v[i];                                                \
+        s->finite++;                                                \
+    }                                                               \
+                                                                    \
+    s->min = lo;                                                    \
+    s->max = hi;                                                    \
+    s->sum = sum;                                                   \
+}
+
+array_summary_float(summary_f32, float, lanes_f32)
+array_summary_float(summary_f64, double, lanes_f64)
+
+
+void __udbg_arraydump(const uint64_t channel, const char *prefix,
+                      const int type, const void *ptr, const int count)
+{
+    if (!channel_on(&state.main, channel))
+    {
+        return;
+    }
+
+    array_summary summary = {.first_bad = -1};
+    int columns = 8;
+
+    if (count > 0)
+    {
+        switch (type)
+        {
+            case __UDBG_F32:
+                summary_f32(ptr, count, &summary);
+                break;
+            case __UDBG_F64:
+                summary_f64(ptr, count, &summary);
+                columns = 4;
+                break;
+            case __UDBG_I32:
+                summary_i32(ptr, count, &summary);
+                break;
+            case __UDBG_I64:
+                summary_i64(ptr, count, &summary);
+                columns = 4;
+                break;
+            case __UDBG_U32:
+                summary_u32(ptr, count, &summary);
+                break;
+            case __UDBG_U64:
+                summary_u64(ptr, count, &summary);
+                columns = 4;
+                break;
+            default:
+                panic("arraydump type");
+        }
+    }
+
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+
+    buf_snprintf(&state.main.buf_output, "%s\n%8s  count %d min %.9g max %.9g mean %.9g"
+                                    " nan %d inf %d first_nonfinite %d\n",
+                 prefix, "", count, summary.min, summary.max,
+                 summary.finite ? summary.sum / summary.finite : 0.0,
+                 summary.nan, summary.inf, summary.first_bad);
+
+    for (int i = 0; i < count; i += columns)
+    {
+        buf_snprintf(&state.main.buf_output, "%8d ", i);
+
+        for (int j = i; j < i + columns && j < count; j++)
+        {
+            switch (type)
+            {
+                case __UDBG_F32:
+                    buf_snprintf(&state.main.buf_output, " %14.7g", ((const float *) ptr)[j]);
+                    break;
+                case __UDBG_F64:
+                    buf_snprintf(&state.main.buf_output, " %24.17g", ((const double *) ptr)[j]);
+                    break;
+                case __UDBG_I32:
+                {
+                    const int32_t v = ((const int32_t *) ptr)[j];
+                    buf_integer(&state.main.buf_output, v < 0 ? -(uint64_t) v : (uint64_t) v, v < 0, 12);
+                    break;
+                }
+                case __UDBG_I64:
+                {
+                    const int64_t v = ((const int64_t *) ptr)[j];
+                    buf_integer(&state.main.buf_output, v < 0 ? -(uint64_t) v : (uint64_t) v, v < 0, 21);
+                    break;
+                }
+                case __UDBG_U32:
+                    buf_integer(&state.main.buf_output, ((const uint32_t *) ptr)[j], 0, 11);
+                    break;
+                case __UDBG_U64:
+                    buf_integer(&state.main.buf_output, ((const uint64_t *) ptr)[j], 0, 21);
+                    break;
+            }
+        }
+
+        buf_snprintf(&state.main.buf_output, "\n");
+    }
+
+    state_flush();
+    state_unlock();
+}
+
+
+//////////////////////////////
+///     latency budget     ///
+//////////////////////////////
+
+void __udbg_budget_report(const __udbg_budget *scope, const uint64_t end_ns)
+{
+    if (!channel_on(&state.main, scope->channel))
+    {
+        return;
+    }
+
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+
+    buf_snprintf(&state.main.buf_output, "%s%s(%u) took %llu us, budget %llu us\n",
+                 scope->prefix, scope->function, scope->line,
+                 (unsigned long long) (end_ns - scope->start_ns) / 1000,
+                 (unsigned long long) scope->budget_ns / 1000);
+
+    for (int i = 0; i < scope->phases; i++)
+    {
+        buf_snprintf(&state.main.buf_output, "%8s  +%llu us %s\n", "",
+                     (unsigned long long) (scope->phase_ns[i] - scope->start_ns) / 1000,
+                     scope->phase_name[i]);
+    }
+
+    // same stack gets printed once, then referred to by its hash
+    const int depth = backtrace(state.trace, UDBG_CALLSTACK);
+    const uint64_t hash = xxh64((const uint8_t *) state.trace, depth * sizeof(void *));
+
+    if (hash_seen(state.stack_seen, UDBG_STACK_SEEN, hash))
+    {
+        buf_snprintf(&state.main.buf_output, "%8s  stack %016llx (repeated)\n",
+                     "", (unsigned long long) hash);
+    }
+    else
+    {
+        buf_snprintf(&state.main.buf_output, "%8s  stack %016llx\n",
+                     "", (unsigned long long) hash);
+        buf_backtrace(&state.main.buf_output, state.trace, depth);
+    }
+
+    state_flush();
+    state_unlock();
+}
+
+
+/////////////////////////////
+///     perf counters     ///
+/////////////////////////////
+
+#define PERF_HW     1
+#define PERF_SW     2
+#define PERF_OFF    -1
+
+static const uint64_t perf_hw_events[] =
+        {
+                PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CACHE_MISSES,
+                PERF_COUNT_HW_BRANCH_MISSES,
+        };
+
+static const uint64_t perf_sw_events[] =
+        {
+                // page faults read as zero in a group led by task-clock
+                PERF_COUNT_SW_PAGE_FAULTS,
+                PERF_COUNT_SW_CONTEXT_SWITCHES,
+                PERF_COUNT_SW_TASK_CLOCK,
+        };
+
+static const char *perf_hw_names[] =
+        {
+                "cycles",
+                "instructions",
+                "cache-misses",
+                "branch-misses",
+        };
+
+static const char *perf_sw_names[] =
+        {
+                "page-faults",
+                "context-switches",
+                "task-clock-ns",
+        };
+
+
+/*
+ *  open one counter group for the calling thread;
+ *  returns zero on success, partial groups are closed
+ */
+static int perf_open_group(udbg_thread *self, const uint32_t type,
+                           const uint64_t *events, const int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = events[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = (type == PERF_TYPE_HARDWARE);
+        attr.exclude_hv = 1;
+
+        const int group = i ? self->perf_fd[0] : -1;
+        const long fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+        {
+            for (int j = 0; j < i; j++)
+            {
+                close(self->perf_fd[j]);
+                self->perf_fd[j] = -1;
+            }
+
+            return -1;
+        }
+
+        self->perf_fd[i] = (int) fd;
+    }
+
+    return 0;
+}
+
+
+// hardware counters first, software ones if there is no pmu
+static void perf_open(udbg_thread *self)
+{
+    if (perf_open_group(self, PERF_TYPE_HARDWARE, perf_hw_events,
+                        sizeof(perf_hw_events) / sizeof(uint64_t)) == 0)
+    {
+        self->perf_mode = PERF_HW;
+        return;
+    }
+
+    if (perf_open_group(self, PERF_TYPE_SOFTWARE, perf_sw_events,
+                        sizeof(perf_sw_events) / sizeof(uint64_t)) == 0)
+    {
+        self->perf_mode = PERF_SW;
+        return;
+    }
+
+    self->perf_mode = PERF_OFF;
+}
+
+
+static void perf_read(const udbg_thread *self, uint64_t *values)
+{
+    struct
+    {
+        uint64_t nr;
+        uint64_t values[__UDBG_PERF_COUNTERS];
+    } group = {0};
+
+    if (read(self->perf_fd[0], &group, sizeof(group)) < 0)
+    {
+        panic("read()");
+    }
+
+    memcpy(values, group.values, sizeof(group.values));
+}
+
+
+__udbg_perf __udbg_perf_begin(const uint64_t channel, __udbg_perf_site *site)
+{
+    __udbg_perf scope = {0};
+    if (!channel_on(&state.main, channel))
+    {
+        return scope;
+    }
+
+    udbg_thread *self = thread_get();
+    if (self->perf_mode == 0)
+    {
+        perf_open(self);
+    }
+
+    scope.site = site;
+    scope.mode = self->perf_mode;
+
+    if (scope.mode != PERF_OFF)
+    {
+        perf_read(self, scope.start);
+    }
+
+    return scope;
+}
+
+
+void __udbg_perf_end(const __udbg_perf *scope)
+{
+    if (scope->mode == 0)
+    {
+        return;
+    }
+
+    uint64_t end[__UDBG_PERF_COUNTERS] = {0};
+    if (scope->mode != PERF_OFF)
+    {
+        perf_read(thread_self, end);
+    }
+
+    __udbg_perf_site *site = scope->site;
+
+    // first recorded call decides the counter set and publishes the site
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&site->mode, &expected, scope->mode, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        __udbg_perf_site *head = __atomic_load_n(&state.perf_sites, __ATOMIC_ACQUIRE);
+        do
+        {
+            site->next = head;
+        } while (!__atomic_compare_exchange_n(&state.perf_sites, &head, site, 0,
+                                              __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+    else if (expected != scope->mode)
+    {
+        // thread got a different counter set, deltas do not mix
+        return;
+    }
+
+    __atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < __UDBG_PERF_COUNTERS; i++)
+    {
+        __atomic_fetch_add(&site->counters[i], end[i] - scope->start[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+// caller holds the lock
+static void stats_perf(udbg_buf *ptr)
+{
+    for (const __udbg_perf_site *site = __atomic_load_n(&state.perf_sites, __ATOMIC_ACQUIRE);
+         site; site = site->next)
+    {
+        const uint64_t calls = __atomic_load_n(&site->calls, __ATOMIC_RELAXED);
+
+        buf_snprintf(ptr, "%s%s %s(%u) calls %llu", site->prefix, site->name,
+                     site->function, site->line, (unsigned long long) calls);
+
+        const char **names = NULL;
+        int count = 0;
+
+        switch (site->mode)
+        {
+            case PERF_HW:
+            {
+                names = perf_hw_names;
+                count = sizeof(perf_hw_names) / sizeof(char *);
+                break;
+            }
+
+            case PERF_SW:
+            {
+                names = perf_sw_names;
+                count = sizeof(perf_sw_names) / sizeof(char *);
+                break;
+            }
+
+            default:
+            {
+                buf_snprintf(ptr, " (no counters)");
+            }
+        }
+
+        for (int i = 0; i < count && calls; i++)
+        {
+            const uint64_t total = __atomic_load_n(&site->counters[i], __ATOMIC_RELAXED);
+            buf_snprintf(ptr, " %s %llu/call", names[i],
+                         (unsigned long long) (total / calls));
+        }
+
+        buf_snprintf(ptr, "\n");
+    }
+}
+
+
+//////////////////////////
+///     thread top     ///
+//////////////////////////
+
+typedef struct
+{
+    pid_t tid;
+    char name[16];
+
+    uint64_t cpu; // utime + stime, in clock ticks
+    uint64_t vcsw;
+    uint64_t ivcsw;
+    uint64_t minflt;
+    uint64_t majflt;
+
+    // not in the previous sample, counters are zero
+    int fresh;
+
+} top_entry;
+
+typedef struct top_sampler
+{
+    uint64_t channel;
+    const char *prefix;
+    int interval;
+    int count;
+    int stop;
+
+    int prev_len;
+    top_entry prev[UDBG_TOP_THREADS];
+    top_entry cur[UDBG_TOP_THREADS];
+    top_entry delta[UDBG_TOP_THREADS];
+
+} top_sampler;
+
+
+// thread exited in between is not an error, just skipped
+static int top_read(const pid_t tid, top_entry *entry)
+{
+    char path[64] = {0};
+    char buf[2048] = {0};
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    if (proc_read(path, buf, sizeof(buf)) == 0)
+    {
+        return -1;
+    }
+
+    // comm may contain anything, including spaces and parentheses
+    const char *open_paren = strchr(buf, '(');
+    const char *close_paren = strrchr(buf, ')');
+    if (open_paren == NULL || close_paren == NULL)
+    {
+        return -1;
+    }
+
+    const int name_len = (int) (close_paren - open_paren - 1);
+    snprintf(entry->name, sizeof(entry->name), "%.*s", name_len, open_paren + 1);
+
+    unsigned long long minflt = 0, majflt = 0, utime = 0, stime = 0;
+    if (sscanf(close_paren + 2, "%*c %*d %*d %*d %*d %*d %*u %llu %*u %llu %*u %llu %llu",
+               &minflt, &majflt, &utime, &stime) != 4)
+    {
+        return -1;
+    }
+
+    entry->tid = tid;
+    entry->cpu = utime + stime;
+    entry->minflt = minflt;
+    entry->majflt = majflt;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+    if (proc_read(path, buf, sizeof(buf)) == 0)
+    {
+        return -1;
+    }
+
+    const char *vcsw = strstr(buf, "voluntary_ctxt_switches:");
+    const char *ivcsw = strstr(buf, "nonvoluntary_ctxt_switches:");
+    if (vcsw == NULL || ivcsw == NULL)
+    {
+        return -1;
+    }
+
+    entry->vcsw = strtoull(vcsw + strlen("voluntary_ctxt_switches:"), NULL, 10);
+    entry->ivcsw = strtoull(ivcsw + strlen("nonvoluntary_ctxt_switches:"), NULL, 10);
+
+    return 0;
+}
+
+
+static int top_collect(top_entry *entries)
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL)
+    {
+        panic("opendir()");
+    }
+
+    int len = 0;
+    struct dirent *ent = NULL;
+
+    while ((ent = readdir(dir)) && len < UDBG_TOP_THREADS)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        if (top_read((pid_t) atoi(ent->d_name), &entries[len]) == 0)
+        {
+            len++;
+        }
+    }
+
+    closedir(dir);
+    return len;
+}
+
+
+/*
+ *  turn absolute values into deltas against previous sample;
+ *  a thread started since has no baseline, its lifetime
+ *  totals are not an interval's worth
+ */
+static void top_delta(const top_sampler *top, top_entry *entry)
+{
+    for (int i = 0; i < top->prev_len; i++)
+    {
+        const top_entry *prev = &top->prev[i];
+        if (prev->tid != entry->tid)
+        {
+            continue;
+        }
+
+        entry->cpu -= prev->cpu;
+        entry->vcsw -= prev->vcsw;
+        entry->ivcsw -= prev->ivcsw;
+        entry->minflt -= prev->minflt;
+        entry->majflt -= prev->majflt;
+        return;
+    }
+
+    entry->cpu = 0;
+    entry->vcsw = 0;
+    entry->ivcsw = 0;
+    entry->minflt = 0;
+    entry->majflt = 0;
+    entry->fresh = 1;
+}
+
+
+static int top_compare(const void *a, const void *b)
+{
+    const top_entry *x = a;
+    const top_entry *y = b;
+
+    return (y->cpu > x->cpu) - (y->cpu < x->cpu);
+}
+
+
+static void top_report(top_sampler *top, const int len)
+{
+    top_entry *delta = top->delta;
+    memcpy(delta, top->cur, len * sizeof(top_entry));
+
+    for (int i = 0; i < len; i++)
+    {
+        top_delta(top, &delta[i]);
+    }
+
+    qsort(delta, len, sizeof(top_entry), top_compare);
+
+    const double ticks = (double) sysconf(_SC_CLK_TCK) * top->interval;
+
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+
+    buf_snprintf(&state.main.buf_output, "%s %ds, %d threads\n%8s  %8s %-16s %6s %8s %8s %8s %8s\n",
+                 top->prefix, top->interval, len, "",
+                 "tid", "name", "cpu%", "vcsw", "ivcsw", "minflt", "majflt");
+
+    for (int i = 0; i < len && i < top->count; i++)
+    {
+        buf_snprintf(&state.main.buf_output, "%8s  %8d %-16s %6.1f %8llu %8llu %8llu %8llu%s\n", "",
+                     delta[i].tid, delta[i].name, delta[i].cpu * 100.0 / ticks,
+                     (unsigned long long) delta[i].vcsw, (unsigned long long) delta[i].ivcsw,
+                     (unsigned long long) delta[i].minflt, (unsigned long long) delta[i].majflt,
+                     delta[i].fresh ? " new" : "");
+    }
+
+    state_flush();
+    state_unlock();
+}
+
+
+static void *top_thread(void *arg)
+{
+    top_sampler *top = arg;
+    top->prev_len = top_collect(top->prev);
+
+    while (1)
+    {
+        const struct timespec delay = {.tv_sec = top->interval};
+        while (nanosleep(&delay, NULL) && errno == EINTR)
+        {
+        }
+
+        if (__atomic_load_n(&top->stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        const int len = top_collect(top->cur);
+        if (channel_on(&state.main, top->channel))
+        {
+            top_report(top, len);
+        }
+
+        memcpy(top->prev, top->cur, len * sizeof(top_entry));
+        top->prev_len = len;
+    }
+
+    free(top);
+    return NULL;
+}
+
+
+void __udbg_thread_top(const uint64_t channel, const char *prefix,
+                       const int interval, const int count)
+{
+    top_sampler *running = __atomic_exchange_n(&state.top, NULL, __ATOMIC_ACQ_REL);
+    if (running)
+    {
+        // exits and frees itself after the current sleep
+        __atomic_store_n(&running->stop, 1, __ATOMIC_RELEASE);
+    }
+
+    if (interval <= 0)
+    {
+        return;
+    }
+
+    top_sampler *top = calloc(1, sizeof(top_sampler));
+    if (top == NULL)
+    {
+        panic("calloc()");
+    }
+
+    top->channel = channel;
+    top->prefix = prefix;
+    top->interval = interval;
+    top->count = count > 0 ? count : UDBG_TOP_THREADS;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic("pthread_attr_init()");
+    }
+
+    if (pthread_create(&thread, &attr, top_thread, top))
+    {
+        panic("pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-top");
+
+    __atomic_store_n(&state.top, top, __ATOMIC_RELEASE);
+}
+
+
+/////////////////////////////
+///     memory report     ///
+/////////////////////////////
+
+void __udbg_mem_report(const uint64_t channel, const char *prefix)
+{
+    if (!channel_on(&state.main, channel))
+    {
+        return;
+    }
+
+    char scratch[4096];
+
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+    buf_snprintf(&state.main.buf_output, "%s\n", prefix);
+
+    buf_memory(&state.main.buf_output, scratch, sizeof(scratch), 1);
+
+    state_flush();
+    state_unlock();
+}
+
+
+typedef struct mem_sampler
+{
+    uint64_t channel;
+    const char *prefix;
+    int interval;
+    uint64_t growth; // kB per second
+    int stop;
+
+} mem_sampler;
+
+
+static uint64_t mem_rss()
+{
+    char buf[4096];
+    if (proc_read("/proc/self/status", buf, sizeof(buf)) == 0)
+    {
+        return 0;
+    }
+
+    return proc_field(buf, "VmRSS:");
+}
+
+
+// quiet until rss grows faster than allowed
+static void *mem_thread(void *arg)
+{
+    mem_sampler *mem = arg;
+    uint64_t prev = mem_rss();
+
+    while (1)
+    {
+        const struct timespec delay = {.tv_sec = mem->interval};
+        while (nanosleep(&delay, NULL) && errno == EINTR)
+        {
+        }
+
+        if (__atomic_load_n(&mem->stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        const uint64_t rss = mem_rss();
+        if (rss > prev && (rss - prev) / mem->interval > mem->growth &&
+            channel_on(&state.main, mem->channel))
+        {
+            char scratch[4096];
+
+            const struct timespec timestamp = state_lock();
+            buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+            buf_snprintf(&state.main.buf_output, "%s rss +%llu kB in %ds\n", mem->prefix,
+                         (unsigned long long) (rss - prev), mem->interval);
+
+            buf_memory(&state.main.buf_output, scratch, sizeof(scratch), 1);
+
+            state_flush();
+            state_unlock();
+        }
+
+        prev = rss;
+    }
+
+    free(mem);
+    return NULL;
+}
+
+
+void __udbg_mem_watch(const uint64_t channel, const char *prefix,
+                      const int interval, const int growth)
+{
+    mem_sampler *running = __atomic_exchange_n(&state.mem, NULL, __ATOMIC_ACQ_REL);
+    if (running)
+    {
+        // exits and frees itself after the current sleep
+        __atomic_store_n(&running->stop, 1, __ATOMIC_RELEASE);
+    }
+
+    if (interval <= 0)
+    {
+        return;
+    }
+
+    mem_sampler *mem = calloc(1, sizeof(mem_sampler));
+    if (mem == NULL)
+    {
+        panic("calloc()");
+    }
+
+    mem->channel = channel;
+    mem->prefix = prefix;
+    mem->interval = interval;
+    mem->growth = growth > 0 ? growth : 0;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic("pthread_attr_init()");
+    }
+
+    if (pthread_create(&thread, &attr, mem_thread, mem))
+    {
+        panic("pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-mem");
+
+    __atomic_store_n(&state.mem, mem, __ATOMIC_RELEASE);
+}
+
+
+//////////////////////////////
+///     stack high-water   ///
+//////////////////////////////
+
+static void stack_report(const char *prefix)
+{
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+    buf_snprintf(&state.main.buf_output, "%s\n", prefix);
+
+    for (const udbg_thread *it = state.threads; it; it = it->next)
+    {
+        if (it->painted)
+        {
+            buf_stack_usage(&state.main.buf_output, it);
+        }
+    }
+
+    state_flush();
+    state_unlock();
+}
+
+
+void __udbg_stack_report(const uint64_t channel, const char *prefix)
+{
+    if (channel_on(&state.main, channel))
+    {
+        stack_report(prefix);
+    }
+}
+
+
+typedef struct stack_sampler
+{
+    uint64_t channel;
+    const char *prefix;
+    int interval;
+    int stop;
+
+} stack_sampler;
+
+
+static void *stack_thread(void *arg)
+{
+    stack_sampler *stack = arg;
+
+    while (1)
+    {
+        const struct timespec delay = {.tv_sec = stack->interval};
+        while (nanosleep(&delay, NULL) && errno == EINTR)
+        {
+        }
+
+        if (__atomic_load_n(&stack->stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        if (channel_on(&state.main, stack->channel))
+        {
+            stack_report(stack->prefix);
+        }
+    }
+
+    free(stack);
+    return NULL;
+}
+
+
+void __udbg_stack_watch(const uint64_t channel, const char *prefix, const int interval)
+{
+    stack_sampler *running = __atomic_exchange_n(&state.stack, NULL, __ATOMIC_ACQ_REL);
+    if (running)
+    {
+        // exits and frees itself after the current sleep
+        __atomic_store_n(&running->stop, 1, __ATOMIC_RELEASE);
+    }
+
+    if (interval <= 0)
+    {
+        return;
+    }
+
+    stack_sampler *stack = calloc(1, sizeof(stack_sampler));
+    if (stack == NULL)
+    {
+        panic("calloc()");
+    }
+
+    stack->channel = channel;
+    stack->prefix = prefix;
+    stack->interval = interval;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic("pthread_attr_init()");
+    }
+
+    if (pthread_create(&thread, &attr, stack_thread, stack))
+    {
+        panic("pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-stack");
+
+    __atomic_store_n(&state.stack, stack, __ATOMIC_RELEASE);
+}
+
+
+////////////////////////////////////
+///     all-thread stack dumps   ///
+////////////////////////////////////
+
+#ifndef UDBG_NO_SIGNALS
+
+/*
+ *  same signal serves two purposes: from another process it
+ *  requests a dump, from this one it asks a thread for its stack;
+ *  only the udbg_stacks_enable() signal requests dumps
+ */
+static void capture_handler(const int sig, siginfo_t *info, void *ctx)
+{
+    (void) ctx;
+
+    const int saved_errno = errno;
+
+    if (info->si_code == SI_TKILL && info->si_pid == getpid())
+    {
+        pid_t expected = gettid();
+        if (__atomic_compare_exchange_n(&state.capture.pending, &expected, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            state.capture.depth = backtrace(state.capture.trace, UDBG_CALLSTACK);
+            sem_post(&state.capture.done);
+        }
+    }
+    else if (sig == state.capture.dump_signal)
+    {
+        sem_post(&state.capture.trigger);
+    }
+
+    errno = saved_errno;
+}
+
+
+/*
+ *  take a stack of another thread into state.capture.trace;
+ *  returns its depth, -1 if the thread is gone or does not
+ *  answer (signal blocked) in time
+ */
+static int capture_thread(const pid_t tid)
+{
+    __atomic_store_n(&state.capture.pending, tid, __ATOMIC_RELEASE);
+
+    if (tgkill(getpid(), tid, state.capture.signal))
+    {
+        __atomic_store_n(&state.capture.pending, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    struct timespec deadline = {0};
+    if (clock_gettime(CLOCK_REALTIME, &deadline))
+    {
+        panic("clock_gettime()");
+    }
+
+    deadline.tv_nsec += UDBG_CAPTURE_WAIT * 1000000l;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000l;
+    deadline.tv_nsec %= 1000000000l;
+
+    while (sem_timedwait(&state.capture.done, &deadline))
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        if (errno != ETIMEDOUT)
+        {
+            panic("sem_timedwait()");
+        }
+
+        pid_t expected = tid;
+        if (__atomic_compare_exchange_n(&state.capture.pending, &expected, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return -1;
+        }
+
+        // handler claimed it just now, it is about to finish
+        while (sem_wait(&state.capture.done) && errno == EINTR)
+        {
+        }
+
+        break;
+    }
+
+    return state.capture.depth;
+}
+
+
+typedef struct
+{
+    pid_t tid;
+    int depth;
+    void *trace[UDBG_CALLSTACK];
+
+} captured_stack;
+
+
+static void stacks_dump()
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL)
+    {
+        panic("opendir()");
+    }
+
+    int len = 0;
+    int capacity = 64;
+    captured_stack *stacks = malloc(capacity * sizeof(captured_stack));
+    if (stacks == NULL)
+    {
+        panic("malloc()");
+    }
+
+    // capture everything first, format later; nobody waits on the lock meanwhile
+    const pid_t self = gettid();
+    struct dirent *ent = NULL;
+
+    pthread_mutex_lock(&state.capture.lock);
+
+    while ((ent = readdir(dir)))
+    {
+        const pid_t tid = (pid_t) atoi(ent->d_name);
+        if (tid <= 0 || tid == self)
+        {
+            continue;
+        }
+
+        if (len == capacity)
+        {
+            capacity *= 2;
+            stacks = realloc(stacks, capacity * sizeof(captured_stack));
+            if (stacks == NULL)
+            {
+                panic("realloc()");
+            }
+        }
+
+        captured_stack *it = &stacks[len++];
+        it->tid = tid;
+        it->depth = capture_thread(tid);
+
+        if (it->depth > 0)
+        {
+            memcpy(it->trace, state.capture.trace, it->depth * sizeof(void *));
+        }
+    }
+
+    pthread_mutex_unlock(&state.capture.lock);
+    closedir(dir);
+
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+    buf_snprintf(&state.main.buf_output, "%s %d threads\n", state.capture.prefix, len);
+
+    for (int i = 0; i < len; i++)
+    {
+        char path[64] = {0};
+        char name[32] = {0};
+
+        snprintf(path, sizeof(path), "/proc/self/task/%d/comm", stacks[i].tid);
+        if (proc_read(path, name, sizeof(name)))
+        {
+            name[strcspn(name, "\n")] = 0;
+        }
+
+        buf_snprintf(&state.main.buf_output, "\nthread %d %s\n", stacks[i].tid, name);
+
+        if (stacks[i].depth > 0)
+        {
+            buf_backtrace(&state.main.buf_output, stacks[i].trace, stacks[i].depth);
+        }
+        else
+        {
+            buf_snprintf(&state.main.buf_output, "[?] no response\n");
+        }
+    }
+
+    state_flush();
+    state_unlock();
+
+    free(stacks);
+}
+
+
+static void *stacks_thread(void *arg)
+{
+    (void) arg;
+
+    while (1)
+    {
+        if (sem_wait(&state.capture.trigger))
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            panic("sem_wait()");
+        }
+
+        if (channel_on(&state.main, state.capture.channel))
+        {
+            stacks_dump();
+        }
+    }
+
+    return NULL;
+}
+
+
+static void stacks_start()
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic("pthread_attr_init()");
+    }
+
+    if (pthread_create(&thread, &attr, stacks_thread, NULL))
+    {
+        panic("pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-stacks");
+}
+
+
+/*
+ *  caller holds the capture lock; the handler goes on every
+ *  signal asked for, the latest one asks threads for stacks
+ */
+static void capture_install(const int sig)
+{
+    if (state.capture.installed == 0)
+    {
+        if (sem_init(&state.capture.trigger, 0, 0) ||
+            sem_init(&state.capture.done, 0, 0))
+        {
+            panic("sem_init()");
+        }
+
+        // first backtrace() loads libgcc, keep that out of the handler
+        void *preload[1];
+        backtrace(preload, 1);
+    }
+
+    if ((state.capture.installed & (1ull << (sig - 1))) == 0)
+    {
+        // restarts read(), write() and the like in the target; epoll_wait(),
+        // nanosleep() and others in signal(7) return EINTR regardless
+        struct sigaction sig_action = {0};
+        sig_action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+        sig_action.sa_sigaction = capture_handler;
+
+        if (sigemptyset(&sig_action.sa_mask))
+        {
+            panic("sigemptyset()");
+        }
+
+        if (sigaction(sig, &sig_action, NULL))
+        {
+            panic("sigaction()");
+        }
+
+        state.capture.installed |= 1ull << (sig - 1);
+    }
+
+    state.capture.signal = sig;
+}
+
+
+/*
+ *  a signal for the profiler: whichever one is installed,
+ *  UDBG_CAPTURE_SIGNAL otherwise, unless the program handles
+ *  that itself; returns -1 then
+ */
+static int capture_default()
+{
+    int ret = 0;
+    pthread_mutex_lock(&state.capture.lock);
+
+    if (state.capture.signal == 0)
+    {
+        struct sigaction old = {0};
+        if (sigaction(UDBG_CAPTURE_SIGNAL, NULL, &old))
+        {
+            panic("sigaction()");
+        }
+
+        if ((old.sa_flags & SA_SIGINFO) == 0 &&
+            (old.sa_handler == SIG_DFL || old.sa_handler == SIG_IGN))
+        {
+            capture_install(UDBG_CAPTURE_SIGNAL);
+        }
+        else
+        {
+            ret = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&state.capture.lock);
+    return ret;
+}
+
+
+void __udbg_stacks_enable(const uint64_t channel, const char *prefix, const int sig)
+{
+    if (state.capture.prefix || sig <= 0 || sig > 64)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&state.capture.lock);
+    capture_install(sig);
+    state.capture.dump_signal = sig;
+    pthread_mutex_unlock(&state.capture.lock);
+
+    state.capture.channel = channel;
+    state.capture.prefix = prefix;
+
+    stacks_start();
+}
+#endif // UDBG_NO_SIGNALS
+
+
+/////////////////////////////////////
+///     wall-clock profiler       ///
+/////////////////////////////////////
+
+#ifndef UDBG_NO_SIGNALS
+typedef struct
+{
+    uint64_t hash;
+    int on_cpu;
+    int depth;
+    uint64_t count;
+    void *trace[UDBG_CALLSTACK];
+
+} wall_stack;
+
+// a sampled thread, its stat file kept open across ticks
+typedef struct
+{
+    pid_t tid;
+    int stat_fd;
+    int on_cpu;
+
+} wall_task;
+
+typedef struct wall_profiler
+{
+    uint64_t channel;
+    const char *prefix;
+    int hz;
+    int seconds;
+
+    uint64_t samples;
+    uint64_t missed; // no response or table full
+    int distinct;
+
+    wall_task tasks[UDBG_TOP_THREADS];
+    int size; // power of two, at most UDBG_WALL_STACKS
+    wall_stack stacks[];
+
+} wall_profiler;
+
+
+// 'R' in /proc stat: running or runnable
+static int wall_on_cpu(wall_task *task)
+{
+    if (task->stat_fd < 0)
+    {
+        char path[64] = {0};
+        snprintf(path, sizeof(path), "/proc/self/task/%d/stat", task->tid);
+
+        task->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (task->stat_fd < 0)
+        {
+            return 0;
+        }
+    }
+
+    char buf[512] = {0};
+    if (pread(task->stat_fd, buf, sizeof(buf) - 1, 0) <= 0)
+    {
+        return 0;
+    }
+
+    // comm may contain anything, state follows the last ')'
+    const char *it = strrchr(buf, ')');
+    return it && it[1] == ' ' && it[2] == 'R';
+}
+
+
+static void wall_free(wall_profiler *wall)
+{
+    for (int i = 0; i < UDBG_TOP_THREADS; i++)
+    {
+        if (wall->tasks[i].stat_fd >= 0)
+        {
+            close(wall->tasks[i].stat_fd);
+        }
+    }
+
+    free(wall);
+}
+
+
+static void wall_record(wall_profiler *wall, const int on_cpu, void **trace, const int depth)
+{
+    const uint64_t hash = xxh64((const uint8_t *) trace, depth * sizeof(void *)) ^ on_cpu;
+
+    for (int i = 0; i < wall->size; i++)
+    {
+        wall_stack *it = &wall->stacks[(hash + i) & (wall->size - 1)];
+        if (it->count == 0)
+        {
+            it->hash = hash;
+            it->on_cpu = on_cpu;
+            it->depth = depth;
+            memcpy(it->trace, trace, depth * sizeof(void *));
+            wall->distinct++;
+        }
+        else if (it->hash != hash || it->on_cpu != on_cpu)
+        {
+            continue;
+        }
+
+        it->count++;
+        wall->samples++;
+        return;
+    }
+
+    wall->missed++;
+}
+
+
+/*
+ *  one sample of every attached thread. states are read in one
+ *  pass before any thread is signaled, since the handler makes
+ *  its thread runnable; one may block or wake before its own
+ *  signal, a skew of at most one pass over the threads
+ */
+static void wall_sample(wall_profiler *wall)
+{
+    int len = 0;
+
+    state_lock();
+    for (const udbg_thread *it = state.threads; it && len < UDBG_TOP_THREADS; it = it->next)
+    {
+        wall_task *task = &wall->tasks[len++];
+        if (task->tid != it->tid && task->stat_fd >= 0)
+        {
+            close(task->stat_fd);
+            task->stat_fd = -1;
+        }
+
+        task->tid = it->tid;
+    }
+    state_unlock();
+
+    for (int i = 0; i < len; i++)
+    {
+        wall->tasks[i].on_cpu = wall_on_cpu(&wall->tasks[i]);
+    }
+
+    pthread_mutex_lock(&state.capture.lock);
+
+    for (int i = 0; i < len; i++)
+    {
+        const int depth = capture_thread(wall->tasks[i].tid);
+
+        if (depth > 0)
+        {
+            wall_record(wall, wall->tasks[i].on_cpu, state.capture.trace, depth);
+        }
+        else
+        {
+            wall->missed++;
+        }
+    }
+
+    pthread_mutex_unlock(&state.capture.lock);
+}
+
+
+typedef struct
+{
+    char *frames;
+    uint64_t count;
+
+} wall_line;
+
+
+static int wall_line_compare(const void *a, const void *b)
+{
+    return strcmp(((const wall_line *) a)->frames, ((const wall_line *) b)->frames);
+}
+
+
+// caller holds the lock; root first, frames joined by ';'
+static void buf_folded(udbg_buf *ptr, const wall_stack *stack)
+{
+    char **symbols = backtrace_symbols(stack->trace, stack->depth);
+    if (symbols == NULL)
+    {
+        panic("backtrace_symbols()");
+    }
+
+    ptr->iterator = 0;
+    buf_snprintf(ptr, "%s", stack->on_cpu ? "on-cpu" : "off-cpu");
+
+    // frame zero is the capture handler
+    for (int i = stack->depth - 1; i > 0; i--)
+    {
+        int len = 0;
+        const char *suffix = NULL;
+        const char *name = frame_name(symbols[i], &len, &suffix);
+
+        if (name)
+        {
+            buf_snprintf(ptr, ";%.*s", len, name);
+        }
+    }
+
+    free(symbols);
+}
+
+
+/*
+ *  stacks differing only in the sampled instruction
+ *  fold to the same frames; merged before output
+ */
+static void wall_report(const wall_profiler *wall)
+{
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+    buf_snprintf(&state.main.buf_output, "%s %ds at %d Hz, %llu samples, %d stacks, %llu missed\n",
+                 wall->prefix, wall->seconds, wall->hz,
+                 (unsigned long long) wall->samples, wall->distinct,
+                 (unsigned long long) wall->missed);
+
+    if (wall->distinct == 0)
+    {
+        state_flush();
+        state_unlock();
+        return;
+    }
+
+    wall_line *lines = malloc(wall->distinct * sizeof(wall_line));
+    udbg_buf *scratch = malloc(sizeof(udbg_buf));
+    if (lines == NULL || scratch == NULL)
+    {
+        panic("malloc()");
+    }
+
+    // demangling goes through the state buffer, so under the lock
+    int len = 0;
+    for (int i = 0; i < wall->size; i++)
+    {
+        if (wall->stacks[i].count == 0)
+        {
+            continue;
+        }
+
+        buf_folded(scratch, &wall->stacks[i]);
+
+        lines[len].frames = strdup(scratch->buf);
+        lines[len].count = wall->stacks[i].count;
+        if (lines[len++].frames == NULL)
+        {
+            panic("strdup()");
+        }
+    }
+
+    qsort(lines, len, sizeof(wall_line), wall_line_compare);
+
+    for (int i = 0; i < len; i++)
+    {
+        uint64_t count = lines[i].count;
+        while (i + 1 < len && strcmp(lines[i].frames, lines[i + 1].frames) == 0)
+        {
+            free(lines[i].frames);
+            count += lines[++i].count;
+        }
+
+        buf_snprintf(&state.main.buf_output, "%s %llu\n",
+                     lines[i].frames, (unsigned long long) count);
+        free(lines[i].frames);
+
+        // any number of stacks, written out as they come
+        if (state.main.buf_output.iterator > UDBG_BUF_LEN / 2)
+        {
+            state_flush();
+        }
+    }
+
+    state_flush();
+    state_unlock();
+
+    free(scratch);
+    free(lines);
+}
+
+
+static void *wall_thread(void *arg)
+{
+    wall_profiler *wall = arg;
+    const long period = 1000000000l / wall->hz;
+
+    struct timespec next = {0};
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (long tick = 0; tick < (long) wall->hz * wall->seconds; tick++)
+    {
+        next.tv_nsec += period;
+        next.tv_sec += next.tv_nsec / 1000000000l;
+        next.tv_nsec %= 1000000000l;
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+        {
+        }
+
+        wall_sample(wall);
+    }
+
+    if (channel_on(&state.main, wall->channel))
+    {
+        wall_report(wall);
+    }
+
+    __atomic_store_n(&state.wall, NULL, __ATOMIC_RELEASE);
+    wall_free(wall);
+
+    return NULL;
+}
+
+
+/*
+ *  sample attached threads hz times a second, running or
+ *  blocked, for the given time; logs folded stacks once done
+ */
+void __udbg_wallprof(const uint64_t channel, const char *prefix,
+                     const int hz, const int seconds)
+{
+    if (hz <= 0 || seconds <= 0)
+    {
+        return;
+    }
+
+    if (capture_default())
+    {
+        __udbg_log(channel, "%s signal %d has a handler, not profiling\n",
+                   prefix, UDBG_CAPTURE_SIGNAL);
+        return;
+    }
+
+    int threads = 1;
+    state_lock();
+    for (const udbg_thread *it = state.threads; it; it = it->next)
+    {
+        threads++;
+    }
+    state_unlock();
+
+    // a stack per sample at most, one thread spare for late attaches
+    const uint64_t rate = hz > 1000 ? 1000 : hz;
+    const uint64_t samples = rate * seconds * threads;
+    int size = 1;
+    while (size < UDBG_WALL_STACKS && (uint64_t) size < samples)
+    {
+        size *= 2;
+    }
+
+    wall_profiler *wall = calloc(1, sizeof(wall_profiler) + size * sizeof(wall_stack));
+    if (wall == NULL)
+    {
+        panic("calloc()");
+    }
+
+    // before it is published, a fork() child closes these
+    for (int i = 0; i < UDBG_TOP_THREADS; i++)
+    {
+        wall->tasks[i].stat_fd = -1;
+    }
+
+    wall_profiler *expected = NULL;
+    if (!__atomic_compare_exchange_n(&state.wall, &expected, wall, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        // one profile at a time
+        free(wall);
+        return;
+    }
+
+    wall->channel = channel;
+    wall->prefix = prefix;
+    wall->hz = (int) rate;
+    wall->seconds = seconds;
+    wall->size = size;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic("pthread_attr_init()");
+    }
+
+    if (pthread_create(&thread, &attr, wall_thread, wall))
+    {
+        panic("pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-wallprof");
+}
+#endif // UDBG_NO_SIGNALS
+
+
+//////////////////////////////////
+///     c++ throw profiler     ///
+//////////////////////////////////
+
+typedef void (*cxa_throw_fn)(void *, void *, void (*)(void *));
+
+typedef struct
+{
+    const void *tinfo;
+    const void *site;
+    uint64_t count;
+
+    // every UDBG_THROW_SAMPLE-th stack is kept, symbolized on report
+    int sampling;
+    int depth;
+    uint64_t hash;
+    void *trace[UDBG_CALLSTACK];
+
+} throw_site;
+
+static throw_site throw_sites[UDBG_THROW_SITES];
+static pthread_mutex_t throw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+#ifndef UDBG_NO_THROW_HOOK
+
+static throw_site *throws_find(const void *tinfo, const void *site)
+{
+    const uint64_t key = (uintptr_t) tinfo ^ ((uintptr_t) site * XXH_P1);
+
+    for (int i = 0; i < UDBG_THROW_SITES; i++)
+    {
+        throw_site *it = &throw_sites[(key + i) & (UDBG_THROW_SITES - 1)];
+        const void *it_site = __atomic_load_n(&it->site, __ATOMIC_ACQUIRE);
+
+        if (it_site == NULL)
+        {
+            return NULL;
+        }
+
+        if (it_site == site && it->tinfo == tinfo)
+        {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+
+// lookups are lock free, only a new site takes the lock
+static throw_site *throws_get(const void *tinfo, const void *site)
+{
+    throw_site *found = throws_find(tinfo, site);
+    if (found)
+    {
+        return found;
+    }
+
+    if (pthread_mutex_lock(&throw_lock))
+    {
+        panic("pthread_mutex_lock()");
+    }
+
+    found = throws_find(tinfo, site);
+    if (found == NULL)
+    {
+        const uint64_t key = (uintptr_t) tinfo ^ ((uintptr_t) site * XXH_P1);
+
+        for (int i = 0; i < UDBG_THROW_SITES; i++)
+        {
+            throw_site *it = &throw_sites[(key + i) & (UDBG_THROW_SITES - 1)];
+            if (it->site == NULL)
+            {
+                it->tinfo = tinfo;
+                __atomic_store_n(&it->site, site, __ATOMIC_RELEASE);
+                found = it;
+                break;
+            }
+        }
+    }
+
+    if (pthread_mutex_unlock(&throw_lock))
+    {
+        panic("pthread_mutex_unlock()");
+    }
+
+    // table full, this one goes uncounted
+    return found;
+}
+
+
+static void throws_record(const void *tinfo, const void *site)
+{
+    throw_site *it = throws_get(tinfo, site);
+    if (it == NULL)
+    {
+        return;
+    }
+
+    const uint64_t count = __atomic_fetch_add(&it->count, 1, __ATOMIC_RELAXED);
+    if (count % UDBG_THROW_SAMPLE)
+    {
+        return;
+    }
+
+    // someone else is sampling this site right now, skip
+    if (__atomic_exchange_n(&it->sampling, 1, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    it->depth = backtrace(it->trace, UDBG_CALLSTACK);
+    it->hash = xxh64((const uint8_t *) it->trace, it->depth * sizeof(void *));
+
+    __atomic_store_n(&it->sampling, 0, __ATOMIC_RELEASE);
+}
+
+
+// the runtime's own, also when it was loaded RTLD_LOCAL
+static cxa_throw_fn throws_next()
+{
+    cxa_throw_fn next = (cxa_throw_fn) dlsym(RTLD_NEXT, "__cxa_throw");
+
+    static const char *runtimes[] = {"libstdc++.so.6", "libc++abi.so.1"};
+    for (int i = 0; next == NULL && i < (int) (sizeof(runtimes) / sizeof(char *)); i++)
+    {
+        void *handle = dlopen(runtimes[i], RTLD_LAZY | RTLD_NOLOAD);
+        if (handle)
+        {
+            next = (cxa_throw_fn) dlsym(handle, "__cxa_throw");
+            dlclose(handle);
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ *  interposes the c++ runtime; needs libudbg ahead of
+ *  libstdc++ in lookup order, which is the default when
+ *  linking with -ludbg or preloading it. left out of the
+ *  static variants, see CMakeLists.txt
+ */
+__UDBG_API __attribute__((noreturn)) void __cxa_throw(void *object, void *tinfo, void (*dest)(void *))
+{
+    static cxa_throw_fn real = NULL;
+
+    cxa_throw_fn next = __atomic_load_n(&real, __ATOMIC_ACQUIRE);
+    if (next == NULL)
+    {
+        next = throws_next();
+        if (next == NULL)
+        {
+            // nothing can finish the throw, end as an uncaught one would
+            dprintf(STDERR_FILENO, "[udbg::throw] no __cxa_throw to forward to\n");
+            abort();
+        }
+
+        __atomic_store_n(&real, next, __ATOMIC_RELEASE);
+    }
+
+    if (is_set(state.main.options, UDBG_THROWS))
+    {
+        throws_record(tinfo, __builtin_return_address(0));
+    }
+
+    next(object, tinfo, dest);
+    __builtin_unreachable();
+}
+
+#endif // UDBG_NO_THROW_HOOK
+
+
+// caller holds the lock
+static void stats_throws(udbg_buf *ptr)
+{
+    for (int i = 0; i < UDBG_THROW_SITES; i++)
+    {
+        throw_site *it = &throw_sites[i];
+        if (__atomic_load_n(&it->site, __ATOMIC_ACQUIRE) == NULL)
+        {
+            continue;
+        }
+
+        // std::type_info: vtable, then the mangled name
+        const char *name = ((const char *const *) it->tinfo)[1];
+        name += (*name == '*');
+
+        char *demangled = NULL;
+#ifndef UDBG_NO_DEMANGLE
+        if (state.demangler)
+        {
+            int status = 0;
+            demangled = state.demangler(name, NULL, NULL, &status);
+        }
+#endif
+
+        buf_snprintf(ptr, "[udbg::throw] %s count %llu",
+                     demangled ? : name,
+                     (unsigned long long) __atomic_load_n(&it->count, __ATOMIC_RELAXED));
+        free(demangled);
+
+        // the function that threw; sites of the same type tell apart without a sample
+        char **symbols = backtrace_symbols((void *const *) &it->site, 1);
+        if (symbols == NULL)
+        {
+            panic("backtrace_symbols()");
+        }
+
+        int len = 0;
+        const char *suffix = NULL;
+        const char *site = frame_name(symbols[0], &len, &suffix);
+
+        buf_snprintf(ptr, " site %p %.*s%s", it->site, site ? len : 1, site ? : "?", site ? suffix : "");
+        free(symbols);
+
+        // leave a sample being written alone
+        if (__atomic_exchange_n(&it->sampling, 1, __ATOMIC_ACQUIRE) == 0)
+        {
+            buf_snprintf(ptr, " stack %016llx\n", (unsigned long long) it->hash);
+            buf_backtrace(ptr, it->trace, it->depth);
+            __atomic_store_n(&it->sampling, 0, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            buf_snprintf(ptr, "\n");
+        }
+    }
+}
+
+
+//////////////////////////////
+///     real-time mode     ///
+//////////////////////////////
+
+static void *rt_thread(void *arg)
+{
+    (void) arg;
+
+    while (!__atomic_load_n(&state.rt.stop, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&state.rt.head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&state.rt.tail, __ATOMIC_ACQUIRE))
+        {
+            // polling, so producers never have to wake us up
+            const struct timespec delay = {.tv_nsec = UDBG_RT_POLL};
+            nanosleep(&delay, NULL);
+            continue;
+        }
+
+        rt_drain(0);
+    }
+
+    return NULL;
+}
+
+
+// whatever is still in the ring at exit(); later records go straight out
+static void rt_exit()
+{
+    state_lock();
+    rt_drain(1);
+    state_unlock();
+}
+
+
+static void rt_flusher(const int cpu, const int policy, const int priority)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pthread_attr_init(&attr) ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    {
+        panic("pthread_attr_init()");
+    }
+
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set))
+        {
+            panic("pthread_attr_setaffinity_np()");
+        }
+    }
+
+    const struct sched_param param = {.sched_priority = priority};
+    if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
+        pthread_attr_setschedpolicy(&attr, policy) ||
+        pthread_attr_setschedparam(&attr, &param))
+    {
+        panic("pthread_attr_setschedpolicy()");
+    }
+
+    int err = pthread_create(&thread, &attr, rt_thread, NULL);
+    if (err == EPERM)
+    {
+        // not allowed to use that policy: keep the default one, say so
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        err = pthread_create(&thread, &attr, rt_thread, NULL);
+
+        __udbg_log((uint64_t) -1, "[udbg::rt] scheduling policy %d not permitted\n", policy);
+    }
+
+    if (err)
+    {
+        panic("pthread_create()");
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_setname_np(thread, "udbg-flush");
+}
+
+
+// mlock() faults the pages in as well; not inherited over fork()
+static void rt_lock_all(uint8_t *ring)
+{
+    rt_lock(ring, UDBG_RT_RING);
+    rt_lock(&state, sizeof(state));
+
+    if (state.buf_demangle)
+    {
+        rt_lock(state.buf_demangle, state.buf_demangle_len);
+    }
+
+    if (thread_self == NULL)
+    {
+        return;
+    }
+
+    rt_lock(thread_self, sizeof(udbg_thread));
+
+    if (thread_self->rec)
+    {
+        rt_lock(thread_self->rec, sizeof(udbg_rec_t));
+    }
+
+    // guard page excluded
+    if (thread_self->alt_stack)
+    {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        rt_lock(thread_self->alt_stack + page, thread_self->alt_stack_len - page);
+    }
+}
+
+
+/*
+ *  prefault and lock everything the logging path touches,
+ *  then move writing out to a flusher thread
+ */
+void __udbg_rt(const int cpu, const int policy, const int priority)
+{
+    if (state.rt.ring)
+    {
+        return;
+    }
+
+    uint8_t *ring = mmap(NULL, UDBG_RT_RING, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+        panic("mmap()");
+    }
+
+    // the calling thread logs without allocating; others are counted
+    thread_rec(thread_get());
+    rt_lock_all(ring);
+
+    // first calls into libgcc and the timezone data allocate
+    void *preload[1];
+    backtrace(preload, 1);
+
+    struct tm local;
+    const time_t now = time(NULL);
+    localtime_r(&now, &local);
+
+    if (atexit(rt_exit))
+    {
+        panic("atexit()");
+    }
+
+    state.rt.cpu = cpu;
+    state.rt.policy = policy;
+    state.rt.priority = priority;
+    rt_flusher(cpu, policy, priority);
+
+    state_lock();
+    state.rt.ring = ring;
+    state_unlock();
+}
+
+
+// caller holds the lock
+static void stats_rt(udbg_buf *ptr)
+{
+    if (state.rt.ring == NULL)
+    {
+        return;
+    }
+
+    buf_snprintf(ptr, "[udbg::rt] dropped %llu (ring full), lock contended %llu, "
+                      "allocated %llu, unlocked %llu bytes\n",
+                 (unsigned long long) __atomic_load_n(&state.rt.ring_full, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n(&state.rt.contended, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n(&state.rt.allocs, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n(&state.rt.unlocked, __ATOMIC_RELAXED));
+}
+
+
+//////////////////////
+///     fork       ///
+//////////////////////
+
+// keep every lock out of other threads' hands across fork()
+static void fork_prepare()
+{
+    pthread_mutex_lock(&throw_lock);
+    state_lock();
+
+    // handles too: one held at fork() would stay locked in the child
+    pthread_mutex_lock(&handles_lock);
+    for (udbg_instance *it = state.handles; it; it = it->next)
+    {
+        instance_lock(it);
+    }
+}
+
+
+static void fork_parent()
+{
+    for (udbg_instance *it = state.handles; it; it = it->next)
+    {
+        instance_unlock(it);
+    }
+    pthread_mutex_unlock(&handles_lock);
+
+    state_unlock();
+    pthread_mutex_unlock(&throw_lock);
+}
+
+
+// only the forking thread made it into the child
+static void fork_threads()
+{
+    udbg_thread **it = &state.threads;
+    while (*it)
+    {
+        udbg_thread *thread = *it;
+        if (thread == thread_self)
         {
-            panic(STDERR_FILENO, "sigemptyset()");
+            it = &thread->next;
+            continue;
         }
 
-        // sa_mask specifies a mask of signals which should be blocked
-        // (i.e., added to the signal mask of the thread in which the signal
-        // handler is invoked) during execution of the signal handler
-        for (unsigned long i = 0; i < sizeof(udbg_signals) / sizeof(int); i++)
+        *it = thread->next;
+
+        if (thread->alt_stack)
         {
-            if (sigaddset(&block_set, udbg_signals[i]))
+            munmap(thread->alt_stack, thread->alt_stack_len);
+        }
+
+        thread_perf_close(thread);
+        free(thread->rec);
+        free(thread);
+    }
+
+    // counters still measure the parent thread, reopen on next use
+    if (thread_self)
+    {
+        thread_perf_close(thread_self);
+    }
+}
+
+
+/*
+ *  fresh locks, own log file if asked for, then
+ *  restart whatever background threads the parent had
+ */
+static void fork_child()
+{
+    trace_tid = 0;
+
+    if (pthread_mutex_init(&state.main.lock, NULL) ||
+        pthread_mutex_init(&throw_lock, NULL) ||
+        pthread_mutex_init(&handles_lock, NULL))
+    {
+        panic(STDERR_FILENO, "pthread_mutex_init()");
+    }
+
+    for (udbg_instance *it = state.handles; it; it = it->next)
+    {
+        if (pthread_mutex_init(&it->lock, NULL))
+        {
+            panic(STDERR_FILENO, "pthread_mutex_init()");
+        }
+    }
+
+    fork_threads();
+
+    // forked while udbg-init ran; the parent writes its early records
+    if (state.initialized && !state.ready)
+    {
+        state.early_len = 0;
+        state.early_dropped = 0;
+
+        if (is_set(state.main.options, UDBG_FORK_SHARD) && state.lazy_path)
+        {
+            char shard[PATH_MAX + 1] = {0};
+            snprintf(shard, sizeof(shard), "%s.%d", state.lazy_path, getpid());
+
+            state.lazy_path = strdup(shard);
+            if (state.lazy_path == NULL)
             {
-                panic(STDERR_FILENO, "sigaddset()");
+                panic(STDERR_FILENO, "strdup()");
             }
         }
+        else
+        {
+            // same file as the parent, truncated there if at all
+            state.main.options &= ~UDBG_TRUNCATE;
+        }
 
-        // deliver signal info
-        // execute handler on alternate stack
-        // reset to default action on entry
-        sig_action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
-        sig_action.sa_mask = block_set;
-        sig_action.sa_sigaction = __udbg_sig_handler;
+        init_start();
+    }
+    else if (is_set(state.main.options, UDBG_FORK_SHARD) && state.path)
+    {
+        char shard[PATH_MAX + 1] = {0};
+        snprintf(shard, sizeof(shard), "%s.%d", state.path, getpid());
 
-        for (unsigned long i = 0; i < sizeof(udbg_signals) / sizeof(int); i++)
+        close(state.main.fd);
+        state.main.fd = instance_open_file(state.main.options, shard);
+        if (state.main.fd < 0)
         {
-            if (sigaction(udbg_signals[i], &sig_action, NULL))
+            panic(STDERR_FILENO, "open()");
+        }
+    }
+
+    if (state.rt.ring)
+    {
+        // parent writes out what it queued
+        state.rt.tail = state.rt.head;
+        state.rt.draining = 0;
+        state.rt.stop = 0;
+        state.rt.ring_full = 0;
+        state.rt.contended = 0;
+        state.rt.allocs = 0;
+        state.rt.unlocked = 0;
+
+        rt_lock_all(state.rt.ring);
+        rt_flusher(state.rt.cpu, state.rt.policy, state.rt.priority);
+    }
+
+    top_sampler *top = state.top;
+    if (top)
+    {
+        // its thread stayed in the parent
+        state.top = NULL;
+        __udbg_thread_top(top->channel, top->prefix, top->interval, top->count);
+        free(top);
+    }
+
+    mem_sampler *mem = state.mem;
+    if (mem)
+    {
+        state.mem = NULL;
+        __udbg_mem_watch(mem->channel, mem->prefix, mem->interval, (int) mem->growth);
+        free(mem);
+    }
+
+    stack_sampler *stack = state.stack;
+    if (stack)
+    {
+        state.stack = NULL;
+        __udbg_stack_watch(stack->channel, stack->prefix, stack->interval);
+        free(stack);
+    }
+
+#ifndef UDBG_NO_SIGNALS
+    if (pthread_mutex_init(&state.capture.lock, NULL))
+    {
+        panic(STDERR_FILENO, "pthread_mutex_init()");
+    }
+
+    if (state.capture.signal)
+    {
+        if (sem_init(&state.capture.trigger, 0, 0) ||
+            sem_init(&state.capture.done, 0, 0))
+        {
+            panic("sem_init()");
+        }
+
+        state.capture.pending = 0;
+    }
+
+    if (state.capture.prefix)
+    {
+        stacks_start();
+    }
+
+    // a profile covers the parent only
+    if (state.wall)
+    {
+        wall_free(state.wall);
+        state.wall = NULL;
+    }
+#endif
+}
+
+
+__attribute__((constructor)) static void fork_init()
+{
+    if (pthread_atfork(fork_prepare, fork_parent, fork_child))
+    {
+        panic(STDERR_FILENO, "pthread_atfork()");
+    }
+}
+
+
+///////////////////////////////////////
+///     environment (LD_PRELOAD)    ///
+///////////////////////////////////////
+
+static const struct
+{
+    const char *name;
+    int value;
+
+} env_options[] =
+        {
+                {"time",        UDBG_TIME},
+                {"truncate",    UDBG_TRUNCATE},
+                {"suffix",      UDBG_SUFFIX},
+                {"nosig",       UDBG_NOSIG},
+                {"core",        UDBG_CORE},
+                {"fingerprint", UDBG_FINGERPRINT},
+                {"fp_first",    UDBG_FP_FIRST},
+                {"stack_paint", UDBG_STACK_PAINT},
+                {"throws",      UDBG_THROWS},
+                {"fork_shard",  UDBG_FORK_SHARD},
+        };
+
+
+// next comma separated token, NULL at the end
+static const char *env_token(const char *str, char *token, const size_t len)
+{
+    if (str == NULL || *str == 0)
+    {
+        return NULL;
+    }
+
+    const size_t amt = strcspn(str, ",");
+    snprintf(token, len, "%.*s", (int) amt, str);
+
+    return str + amt + (str[amt] == ',');
+}
+
+
+// "time,core" or a number
+static int env_opt(const char *str)
+{
+    char token[32] = {0};
+    int opt = 0;
+
+    while ((str = env_token(str, token, sizeof(token))))
+    {
+        char *end = NULL;
+        const long value = strtol(token, &end, 0);
+
+        if (*end == 0)
+        {
+            opt |= (int) value;
+            continue;
+        }
+
+        for (unsigned long i = 0; i < sizeof(env_options) / sizeof(env_options[0]); i++)
+        {
+            if (strcasecmp(token, env_options[i].name) == 0)
             {
-                // let this also indicate which signal caused a failure
-                panic(STDERR_FILENO, sigabbrev_np(udbg_signals[i]));
+                opt |= env_options[i].value;
+            }
+        }
+    }
+
+    return opt;
+}
+
+
+#ifndef UDBG_NO_SIGNALS
+// "USR2", "SIGUSR2" or a number; -1 if unknown
+static int env_signal(const char *str)
+{
+    if (str == NULL || *str == 0)
+    {
+        return SIGUSR2;
+    }
+
+    char *end = NULL;
+    const long value = strtol(str, &end, 10);
+    if (*end == 0)
+    {
+        return value > 0 && value < 65 ? (int) value : -1;
+    }
+
+    if (strncasecmp(str, "SIG", 3) == 0)
+    {
+        str += 3;
+    }
+
+    for (int sig = 1; sig < SIGRTMIN; sig++)
+    {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev && strcasecmp(abbrev, str) == 0)
+        {
+            return sig;
+        }
+    }
+
+    return -1;
+}
+#endif
+
+
+/*
+ *  "threadtop:interval:count,stacks:signal,mem:interval:growth,
+ *  wallprof:hz:seconds"; output goes to every channel, the
+ *  binary knows nothing about them. a typo skips that profiler,
+ *  it must not take down the host
+ */
+static void env_profile(const char *str)
+{
+    char token[64] = {0};
+
+    while ((str = env_token(str, token, sizeof(token))))
+    {
+        char *arg = strchr(token, ':');
+        if (arg)
+        {
+            *arg++ = 0;
+        }
+
+        if (strcasecmp(token, "threadtop") == 0)
+        {
+            int interval = 10;
+            int count = 10;
+
+            if (arg)
+            {
+                sscanf(arg, "%d:%d", &interval, &count);
+            }
+
+            __udbg_thread_top((uint64_t) -1, "[udbg::threadtop]", interval, count);
+        }
+        else if (strcasecmp(token, "mem") == 0)
+        {
+            int interval = 10;
+            int growth = 0;
+
+            if (arg)
+            {
+                sscanf(arg, "%d:%d", &interval, &growth);
             }
+
+            __udbg_mem_watch((uint64_t) -1, "[udbg::mem]", interval, growth);
+        }
+#ifndef UDBG_NO_SIGNALS
+        else if (strcasecmp(token, "stacks") == 0)
+        {
+            const int sig = env_signal(arg);
+            if (sig < 0)
+            {
+                dprintf(STDERR_FILENO, "[udbg::env] UDBG_PROFILE unknown signal %s, stacks skipped\n", arg);
+                continue;
+            }
+
+            __udbg_stacks_enable((uint64_t) -1, "[udbg::stacks]", sig);
+        }
+        else if (strcasecmp(token, "wallprof") == 0)
+        {
+            int hz = 99;
+            int seconds = 30;
+
+            if (arg)
+            {
+                sscanf(arg, "%d:%d", &hz, &seconds);
+            }
+
+            // constructors run on the main thread, the only one known here
+            __udbg_thread_attach();
+            __udbg_wallprof((uint64_t) -1, "[udbg::wallprof]", hz, seconds);
+        }
+#endif
+        else
+        {
+            dprintf(STDERR_FILENO, "[udbg::env] UDBG_PROFILE unknown %s, skipped\n", token);
+        }
+    }
+}
+
+
+/*
+ *  initialize from the environment when loaded into a binary
+ *  that was not built against udbg.h, e.g. with LD_PRELOAD.
+ *  does nothing unless at least one variable is set
+ */
+__attribute__((constructor)) static void env_init()
+{
+    const char *path = getenv("UDBG_PATH");
+    const char *opt = getenv("UDBG_OPT");
+    const char *channels = getenv("UDBG_CHANNELS");
+    const char *profile = getenv("UDBG_PROFILE");
+    const char *sample = getenv("UDBG_SAMPLE");
+
+    // sampling alone leaves initialization to the program
+    if (sample)
+    {
+        __udbg_sample_rate(strtod(sample, NULL));
+    }
+
+    if (!path && !opt && !channels && !profile)
+    {
+        return;
+    }
+
+    // c++ binaries bring their own demangler
+    void *demangler = NULL;
+#ifndef UDBG_NO_DEMANGLE
+    demangler = dlsym(RTLD_DEFAULT, "__cxa_demangle");
+#endif
+
+    __udbg_init(demangler, (path && *path) ? path : NULL,
+                env_opt(opt), channels ? strtoull(channels, NULL, 0) : 0);
+
+    env_profile(profile);
+}
+
+
+//////////////////////////////
+///     named channels     ///
+//////////////////////////////
+
+// checked inline by udbg_logc()
+uint8_t __udbg_named_on[__UDBG_NAMED_MAX];
+
+
+/*
+ *  "net.*,-net.tcp.*,~net.tcp.rx": glob patterns, '-'
+ *  disables, '~' enables for sampled requests only, last
+ *  match wins. unmatched channels are enabled unless there
+ *  is at least one enabling rule
+ */
+static uint8_t named_enabled(const char *name)
+{
+    const char *rules = state.named.rules;
+    char token[256] = {0};
+    uint8_t enabled = 1;
+
+    for (const char *it = rules; (it = env_token(it, token, sizeof(token)));)
+    {
+        if (token[0] != '-')
+        {
+            enabled = 0;
+            break;
+        }
+    }
+
+    while ((rules = env_token(rules, token, sizeof(token))))
+    {
+        const int negative = token[0] == '-';
+        const int sampled = token[0] == '~';
+        if (fnmatch(token + negative + sampled, name, 0) == 0)
+        {
+            enabled = negative ? 0 : sampled ? 2 : 1;
         }
     }
 
-    // open the log file
-    if (path)
+    return enabled;
+}
+
+
+// caller holds the lock; slot in the name index
+static uint16_t *named_slot(const char *name)
+{
+    const uint64_t hash = xxh64((const uint8_t *) name, strlen(name));
+
+    for (int i = 0; i < UDBG_NAMED_INDEX; i++)
     {
-        // and if the suffix attr is set,
-        // get current time and form a full path
-        const char *path_ptr = path;
-        if (is_set(opt, UDBG_SUFFIX))
+        uint16_t *slot = &state.named.index[(hash + i) & (UDBG_NAMED_INDEX - 1)];
+        if (*slot == 0 || strcmp(state.named.names[*slot], name) == 0)
         {
-            char time_str[32] = {0};
-            struct timespec time = {0};
-            if (clock_gettime(CLOCK_REALTIME, &time))
-            {
-                panic(STDERR_FILENO, "clock_gettime()");
-            }
+            return slot;
+        }
+    }
 
-            const struct tm *ts = localtime(&time.tv_sec);
-            if (ts == NULL)
-            {
-                panic(STDERR_FILENO, "localtime()");
-            }
+    return NULL;
+}
 
-            if (strftime(time_str, 32, "%F_%X", ts) != 19)
-            {
-                panic(STDERR_FILENO, "strftime()");
-            }
 
-            const int amt = snprintf(state.buf_output.buf, UDBG_BUF, "%s_%s.log",
-                                     path, time_str);
-            if (amt == -1)
-            {
-                panic(STDERR_FILENO, "snprint()");
-            }
+int __udbg_channel(const char *name)
+{
+    state_lock();
 
-            // path can become too long after appending suffix
-            if (amt > PATH_MAX)
-            {
-                panic(STDERR_FILENO, "PATH_MAX");
-            }
+    uint16_t *slot = named_slot(name);
+    int id = slot ? *slot : 0;
 
-            path_ptr = state.buf_output.buf;
-        }
+    if (slot && id == 0 && state.named.count + 1 < __UDBG_NAMED_MAX)
+    {
+        id = ++state.named.count;
 
-        // finally open the file
-        int fd_opt = O_WRONLY | O_CREAT | O_APPEND;
-        if (state.options & UDBG_TRUNCATE)
+        state.named.names[id] = strdup(name);
+        if (state.named.names[id] == NULL)
         {
-            fd_opt |= O_TRUNC;
+            panic("strdup()");
         }
 
-        const int fd = open(path_ptr, fd_opt, 0600);
-        if (fd < 0)
-        {
-            panic(STDERR_FILENO, "open()");
-        }
+        *slot = (uint16_t) id;
+        __udbg_named_on[id] = named_enabled(name);
+    }
+
+    state_unlock();
+
+    // out of ids: zero, which is never enabled
+    return id;
+}
+
+
+void __udbg_channels_enable(const char *rules)
+{
+    state_lock();
 
-        state.fd = fd;
+    free(state.named.rules);
+    state.named.rules = strdup(rules);
+    if (state.named.rules == NULL)
+    {
+        panic("strdup()");
     }
 
-    if (demangler)
+    for (int id = 1; id <= state.named.count; id++)
     {
-        state.buf_demangle = malloc(UDBG_BUF);
-        if (state.buf_demangle == NULL)
-        {
-            panic(STDERR_FILENO, "malloc()");
-        }
+        __udbg_named_on[id] = named_enabled(state.named.names[id]);
     }
+
+    state_unlock();
 }
 
 
-void __udbg_throwfmt(const char *fmt, ...)
+void __udbg_logc(const int id, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    const struct timespec timestamp = state_lock(); // no return => no unlock
 
-    buf_timestamp(state.options, &timestamp, &state.buf_output);
-    buf_vaprintf(&state.buf_output, fmt, args);
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+
+    buf_snprintf(&state.main.buf_output, "[%s::", state.named.names[id]);
+    buf_vaprintf(&state.main.buf_output, fmt, args);
 
     va_end(args);
+    state_flush();
+    state_unlock();
+}
 
-    const int depth = backtrace(state.trace, UDBG_CALLSTACK);
-    buf_backtrace(&state.buf_output, depth);
 
-    buf_flush(state.fd, &state.buf_output);
-    exit_stub();
+/////////////////////////////
+///     head sampling     ///
+/////////////////////////////
+
+// well mixed even for sequential ids
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+
+    return x ^ (x >> 31);
 }
 
 
-void __udbg_log(const uint64_t channel, const char *fmt, ...)
+// fraction of trace ids sampled, same in every process
+void __udbg_sample_rate(const double rate)
 {
-    if (!is_set(state.channels_mask, channel))
+    uint64_t threshold = 0;
+    if (rate >= 1.0)
     {
-        return;
+        threshold = UINT64_MAX;
+    }
+    else if (rate > 0.0)
+    {
+        threshold = (uint64_t) (rate * 18446744073709551616.0);
     }
 
-    va_list args;
-    va_start(args, fmt);
-    const struct timespec timestamp = state_lock();
+    __atomic_store_n(&state.sample_threshold, threshold, __ATOMIC_RELAXED);
+}
 
-    buf_timestamp(state.options, &timestamp, &state.buf_output);
-    buf_vaprintf(&state.buf_output, fmt, args);
 
-    va_end(args);
-    buf_flush(state.fd, &state.buf_output);
+void __udbg_channels_sampled(const uint64_t mask)
+{
+    state_lock();
+    state.main.sampled_mask = mask;
     state_unlock();
 }
 
 
-///////////////////////////////
-///     hex & bin dumps     ///
-///////////////////////////////
+// decision depends on the trace id only, returns it
+int __udbg_sample_ctx_set(const uint64_t trace_id)
+{
+    const uint64_t threshold = __atomic_load_n(&state.sample_threshold, __ATOMIC_RELAXED);
+    const int sampled = threshold && splitmix64(trace_id) <= threshold - 1;
 
-// decide if this char is printable
-static inline char asc_output(const uint8_t ch)
+    __udbg_ctx_sampled = sampled ? 2 : 0;
+    return sampled;
+}
+
+
+/////////////////////
+///     flows     ///
+/////////////////////
+
+typedef struct trace_event
 {
-    if (ch > 0x1f && ch < 0x7f)
+    // index + 1 once complete, tells overwritten slots apart
+    uint64_t seq;
+    uint64_t ts;
+    uint64_t id;
+    const char *function;
+    unsigned line;
+    pid_t tid;
+    char phase;
+
+} trace_event;
+
+static trace_event *trace_ring()
+{
+    trace_event *ring = __atomic_load_n(&state.trace_ring, __ATOMIC_ACQUIRE);
+    if (ring)
     {
-        return (char) ch;
+        return ring;
     }
 
-    return '.';
+    ring = mmap(NULL, UDBG_TRACE_EVENTS * sizeof(trace_event), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+        panic("mmap()");
+    }
+
+    trace_event *expected = NULL;
+    if (!__atomic_compare_exchange_n(&state.trace_ring, &expected, ring, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        // lost the race
+        munmap(ring, UDBG_TRACE_EVENTS * sizeof(trace_event));
+        ring = expected;
+    }
+
+    return ring;
 }
 
-// convert a byte to printable form
-static inline void hex_converter(const uint8_t input, char *output)
+
+// phase: 's' begin, 't' step, 'f' end, as in chrome flow events
+void __udbg_flow(const uint64_t id, const int phase,
+                 const char *function, const unsigned line)
 {
-    const char hex[] = "0123456789abcdef";
+    trace_event *ring = trace_ring();
+    const uint64_t index = __atomic_fetch_add(&state.trace_next, 1, __ATOMIC_RELAXED);
+    trace_event *it = &ring[index & (UDBG_TRACE_EVENTS - 1)];
 
-    output[0] = hex[input >> 4];
-    output[1] = hex[input & 0xf];
-    output[2] = ' ';
+    if (trace_tid == 0)
+    {
+        trace_tid = gettid();
+    }
+
+    __atomic_store_n(&it->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // the exporter may read the slot meanwhile, seq tells it apart
+    __atomic_store_n(&it->ts, __udbg_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&it->id, id, __ATOMIC_RELAXED);
+    __atomic_store_n(&it->function, function, __ATOMIC_RELAXED);
+    __atomic_store_n(&it->line, line, __ATOMIC_RELAXED);
+    __atomic_store_n(&it->tid, trace_tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&it->phase, (char) phase, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&it->seq, index + 1, __ATOMIC_RELEASE);
 }
 
 
-void __udbg_hexdump(const uint64_t channel, const char *prefix,
-                    const void *ptr, const int len)
+static int trace_compare(const void *a, const void *b)
 {
-    if (!is_set(state.channels_mask, channel))
+    const trace_event *x = a;
+    const trace_event *y = b;
+
+    if (x->id != y->id)
     {
-        return;
+        return x->id < y->id ? -1 : 1;
     }
 
-    const struct timespec timestamp = state_lock();
-    buf_timestamp(state.options, &timestamp, &state.buf_output);
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
 
-    const uint8_t *data = (uint8_t *) ptr;
-    const uint8_t *data_end = data + len;
 
-    buf_snprintf(&state.buf_output, "%s\n", prefix);
+static void trace_write(const int fd, udbg_buf *ptr)
+{
+    if (ptr->iterator > UDBG_BUF_LEN / 2)
+    {
+        buf_flush(fd, ptr);
+    }
+}
+
 
-    //
-    for (int i = 0; i < len; i += 16)
+/*
+ *  write flow events as chrome trace json: a short slice per
+ *  event for the arrows to bind to, time since the previous
+ *  hop of the same flow in its args; -1 and errno if the
+ *  file can't be created
+ */
+int __udbg_trace_export(const char *path)
+{
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
     {
-        char ascii[32] = {0};
-        char left[32] = {0};
-        char right[32] = {0};
-        const uint8_t *row = data + i;
-        int asc_offset = 0;
+        return -1;
+    }
 
-        for (int j = 0; j < 24 && row != data_end; j += 3)
+    trace_event *ring = __atomic_load_n(&state.trace_ring, __ATOMIC_ACQUIRE);
+    const uint64_t next = __atomic_load_n(&state.trace_next, __ATOMIC_ACQUIRE);
+    const uint64_t first = next > UDBG_TRACE_EVENTS ? next - UDBG_TRACE_EVENTS : 0;
+
+    trace_event *events = malloc((next - first + 1) * sizeof(trace_event));
+    udbg_buf *buf = malloc(sizeof(udbg_buf));
+    if (events == NULL || buf == NULL)
+    {
+        panic("malloc()");
+    }
+
+    // copy out what is complete and not overwritten since
+    int len = 0;
+    for (uint64_t i = first; ring && i < next; i++)
+    {
+        const trace_event *it = &ring[i & (UDBG_TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&it->seq, __ATOMIC_ACQUIRE) != i + 1)
         {
-            hex_converter(*row, left + j);
-            ascii[asc_offset++] = asc_output(*row);
-            row += 1;
+            continue;
         }
 
-        for (int j = 0; j < 24 && row != data_end; j += 3)
+        trace_event *copy = &events[len];
+        copy->ts = __atomic_load_n(&it->ts, __ATOMIC_RELAXED);
+        copy->id = __atomic_load_n(&it->id, __ATOMIC_RELAXED);
+        copy->function = __atomic_load_n(&it->function, __ATOMIC_RELAXED);
+        copy->line = __atomic_load_n(&it->line, __ATOMIC_RELAXED);
+        copy->tid = __atomic_load_n(&it->tid, __ATOMIC_RELAXED);
+        copy->phase = __atomic_load_n(&it->phase, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&it->seq, __ATOMIC_RELAXED) == i + 1)
         {
-            hex_converter(*row, right + j);
-            ascii[asc_offset++] = asc_output(*row);
-            row += 1;
+            len++;
+        }
+    }
+
+    qsort(events, len, sizeof(trace_event), trace_compare);
+
+    const pid_t pid = getpid();
+    buf->iterator = 0;
+    buf_snprintf(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (int i = 0; i < len; i++)
+    {
+        const trace_event *it = &events[i];
+        const int same = i > 0 && events[i - 1].id == it->id;
+        const double hop = same ? (double) (it->ts - events[i - 1].ts) / 1000.0 : 0.0;
+        const double ts = (double) it->ts / 1000.0;
+
+        buf_snprintf(buf, "{\"name\":\"%s\",\"cat\":\"udbg\",\"ph\":\"X\",\"ts\":%.3f,"
+                          "\"dur\":1,\"pid\":%d,\"tid\":%d,\"args\":{\"flow\":%llu,"
+                          "\"line\":%u,\"hop_us\":%.3f}},\n",
+                     it->function, ts, pid, it->tid,
+                     (unsigned long long) it->id, it->line, hop);
+
+        buf_snprintf(buf, "{\"name\":\"flow\",\"cat\":\"udbg\",\"ph\":\"%c\",\"bp\":\"e\","
+                          "\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}%s\n",
+                     it->phase, (unsigned long long) it->id, ts, pid, it->tid,
+                     i + 1 < len ? "," : "");
+
+        trace_write(fd, buf);
+    }
+
+    buf_snprintf(buf, "]}\n");
+    buf_flush(fd, buf);
+
+    close(fd);
+    free(buf);
+    free(events);
+
+    return 0;
+}
+
+
+////////////////////////////
+///     queue probes     ///
+////////////////////////////
+
+#define QUEUE_EMPTY         0                   // item slot keys
+#define QUEUE_BUSY          1
+
+typedef struct __udbg_queue
+{
+    struct __udbg_queue *next;
+    char *name;
+
+    int64_t depth;
+    int64_t depth_max;
+    uint64_t enqueued;
+    uint64_t dequeued;
+
+    // dequeued without a time: slot taken by another item
+    uint64_t untimed;
+
+    // log2 of nanoseconds between enqueue and dequeue
+    uint64_t sojourn[64];
+
+} queue_probe;
+
+typedef struct queue_item
+{
+    uint64_t key;
+    uint64_t ts;
+
+} queue_item;
+
+
+// once per call site, the pointer is cached there
+queue_probe *__udbg_queue_get(const char *name)
+{
+    state_lock();
+
+    queue_probe *it = state.queues;
+    while (it && strcmp(it->name, name) != 0)
+    {
+        it = it->next;
+    }
+
+    if (it == NULL)
+    {
+        if (state.queue_items == NULL)
+        {
+            queue_item *items = mmap(NULL, UDBG_QUEUE_ITEMS * sizeof(queue_item),
+                                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (items == MAP_FAILED)
+            {
+                panic("mmap()");
+            }
+
+            __atomic_store_n(&state.queue_items, items, __ATOMIC_RELEASE);
         }
 
-        buf_snprintf(&state.buf_output, "%8d  %-24s %-24s |%-16s|\n",
-                     i, left, right, ascii);
+        it = calloc(1, sizeof(queue_probe));
+        if (it == NULL || (it->name = strdup(name)) == NULL)
+        {
+            panic("malloc()");
+        }
+
+        it->next = state.queues;
+        __atomic_store_n(&state.queues, it, __ATOMIC_RELEASE);
     }
 
-    buf_flush(state.fd, &state.buf_output);
     state_unlock();
+    return it;
 }
 
 
-void __udbg_bindump(const uint64_t channel, const char *prefix,
-                    const void *ptr, const int len)
+// slot and key of an item; keys are never empty or busy
+static queue_item *queue_slot(const queue_probe *q, const uint64_t item, uint64_t *key)
+{
+    const uint64_t hash = splitmix64((uintptr_t) q ^ splitmix64(item));
+    *key = hash | 2;
+
+    queue_item *items = __atomic_load_n(&state.queue_items, __ATOMIC_ACQUIRE);
+    return &items[hash & (UDBG_QUEUE_ITEMS - 1)];
+}
+
+
+/*
+ *  no locks: an item's time sits in a direct mapped slot,
+ *  claimed by moving its key through busy. an item that
+ *  can't claim its slot, or whose slot was reused, is
+ *  counted as untimed instead of waited for
+ */
+void __udbg_queue_enqueue(queue_probe *q, const uint64_t item)
 {
-    if (!is_set(state.channels_mask, channel))
+    const int64_t depth = __atomic_add_fetch(&q->depth, 1, __ATOMIC_RELAXED);
+    int64_t max = __atomic_load_n(&q->depth_max, __ATOMIC_RELAXED);
+    while (depth > max && !__atomic_compare_exchange_n(&q->depth_max, &max, depth, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+
+    __atomic_fetch_add(&q->enqueued, 1, __ATOMIC_RELAXED);
+
+    uint64_t key;
+    queue_item *it = queue_slot(q, item, &key);
+
+    uint64_t seen = __atomic_load_n(&it->key, __ATOMIC_RELAXED);
+    if (seen == QUEUE_BUSY ||
+        !__atomic_compare_exchange_n(&it->key, &seen, QUEUE_BUSY, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
     {
         return;
     }
 
-    const struct timespec timestamp = state_lock();
-    const uint8_t *data = (uint8_t *) ptr;
+    __atomic_store_n(&it->ts, __udbg_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&it->key, key, __ATOMIC_RELEASE);
+}
 
-    buf_timestamp(state.options, &timestamp, &state.buf_output);
-    buf_snprintf(&state.buf_output, "%s\n", prefix);
 
-    for (int i = 0; i < len; i += 8)
+void __udbg_queue_dequeue(queue_probe *q, const uint64_t item)
+{
+    const uint64_t now = __udbg_now_ns();
+
+    __atomic_sub_fetch(&q->depth, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&q->dequeued, 1, __ATOMIC_RELAXED);
+
+    uint64_t key;
+    queue_item *it = queue_slot(q, item, &key);
+
+    uint64_t expected = key;
+    if (!__atomic_compare_exchange_n(&it->key, &expected, QUEUE_BUSY, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
     {
-        char decoded_row[72] = {0};
-        int iterator = 0;
+        __atomic_fetch_add(&q->untimed, 1, __ATOMIC_RELAXED);
+        return;
+    }
 
-        for (int j = 0; j < 8 && j + i < len; j++)
+    const uint64_t ts = __atomic_load_n(&it->ts, __ATOMIC_RELAXED);
+    __atomic_store_n(&it->key, QUEUE_EMPTY, __ATOMIC_RELEASE);
+
+    const uint64_t ns = now > ts ? now - ts : 0;
+    __atomic_fetch_add(&q->sojourn[63 - __builtin_clzll(ns | 1)], 1, __ATOMIC_RELAXED);
+}
+
+
+// caller holds the lock
+static void stats_queues(udbg_buf *ptr)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 1.0};
+    static const char *names[] = {"p50", "p90", "p99", "max"};
+
+    for (const queue_probe *q = __atomic_load_n(&state.queues, __ATOMIC_ACQUIRE); q; q = q->next)
+    {
+        buf_snprintf(ptr, "[udbg::queue] %s depth %lld max %lld enqueued %llu dequeued %llu untimed %llu\n",
+                     q->name,
+                     (long long) __atomic_load_n(&q->depth, __ATOMIC_RELAXED),
+                     (long long) __atomic_load_n(&q->depth_max, __ATOMIC_RELAXED),
+                     (unsigned long long) __atomic_load_n(&q->enqueued, __ATOMIC_RELAXED),
+                     (unsigned long long) __atomic_load_n(&q->dequeued, __ATOMIC_RELAXED),
+                     (unsigned long long) __atomic_load_n(&q->untimed, __ATOMIC_RELAXED));
+
+        uint64_t sojourn[64];
+        uint64_t total = 0;
+        for (int i = 0; i < 64; i++)
         {
-            const uint8_t byte = data[i + j];
+            sojourn[i] = __atomic_load_n(&q->sojourn[i], __ATOMIC_RELAXED);
+            total += sojourn[i];
+        }
 
-            for (char k = 7; k >= 0; k--)
+        if (total == 0)
+        {
+            continue;
+        }
+
+        // quantiles as bucket upper bounds
+        buf_snprintf(ptr, "[udbg::queue] %s sojourn", q->name);
+        for (int i = 0; i < 4; i++)
+        {
+            const uint64_t rank = (uint64_t) (quantiles[i] * (double) (total - 1)) + 1;
+
+            int bucket = 0;
+            uint64_t seen = sojourn[0];
+            while (seen < rank)
             {
-                const char symbol = (byte & (1 << k)) ? '1' : '0';
-                decoded_row[iterator++] = symbol;
+                seen += sojourn[++bucket];
             }
 
-            decoded_row[iterator++] = ' ';
+            buf_snprintf(ptr, " %s < %llu ns", names[i],
+                         bucket < 63 ? 2ull << bucket : (unsigned long long) UINT64_MAX);
+        }
+        buf_snprintf(ptr, "\n");
+
+        buf_snprintf(ptr, "[udbg::queue] %s histogram", q->name);
+        for (int i = 0; i < 64; i++)
+        {
+            if (sojourn[i])
+            {
+                buf_snprintf(ptr, " %llu:%llu", 1ull << i, (unsigned long long) sojourn[i]);
+            }
         }
+        buf_snprintf(ptr, "\n");
+    }
+}
 
-        buf_snprintf(&state.buf_output, "%8d  %s\n", i, decoded_row);
+
+/////////////////////
+///     stats     ///
+/////////////////////
+
+void __udbg_stats(const uint64_t channel, const char *prefix)
+{
+    if (!channel_on(&state.main, channel))
+    {
+        return;
     }
 
-    buf_flush(state.fd, &state.buf_output);
+    const struct timespec timestamp = state_lock();
+    buf_timestamp(state.main.options, &timestamp, &state.main.buf_output);
+
+    buf_snprintf(&state.main.buf_output, "%s\n", prefix);
+    stats_perf(&state.main.buf_output);
+    stats_throws(&state.main.buf_output);
+    stats_rt(&state.main.buf_output);
+    stats_queues(&state.main.buf_output);
+
+    state_flush();
     state_unlock();
 }
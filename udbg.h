@@ -25,19 +25,114 @@
 // during crash, exception, assert
 #define UDBG_CORE           0x10
 
+// hex dumps emit a fingerprint instead:
+// length, xxh64 hash, first and last 16 bytes
+#define UDBG_FINGERPRINT    0x20
+
+// with UDBG_FINGERPRINT, dump in full the
+// first time each hash is seen
+#define UDBG_FP_FIRST       0x40
+
+// paint stacks of attached threads to
+// measure their deepest usage. commits
+// the whole stack to memory
+#define UDBG_STACK_PAINT    0x80
+
+// count c++ throws per exception type
+// and throw site, sampling their stacks.
+// reported by udbg_stats(). libudbg.so only,
+// the static variants leave the hook out
+// unless built with UDBG_STATIC_THROW_HOOK
+#define UDBG_THROWS         0x100
+
+// return from udbg_init() right away; open
+// files and load libgcc in the background.
+// records are kept in memory meanwhile
+#define UDBG_LAZY           0x200
+
+// forked children log to path.pid instead of
+// sharing the parent's file
+#define UDBG_FORK_SHARD     0x400
+
+
+///////////////////////////
+///     environment     ///
+///////////////////////////
+// libudbg initializes itself when any of these is
+// set, so LD_PRELOAD=libudbg.so works on binaries
+// built without udbg. a later udbg_init() is ignored
+//
+// UDBG_PATH       log file, STDERR if empty
+// UDBG_OPT        options: "time,core,throws" or a number
+// UDBG_CHANNELS   channels mask, a number
+// UDBG_PROFILE    "threadtop[:interval[:count]]",
+//                 "stacks[:signal]", "mem[:interval[:growth]]",
+//                 "wallprof[:hz[:seconds]]" of the main thread,
+//                 comma separated; unknown ones are skipped
+// UDBG_SAMPLE     head sampling rate, see udbg_sample_rate();
+//                 alone it doesn't initialize
+
+
+///////////////////////////
+///     build           ///
+///////////////////////////
+// libudbg.so, plus libudbg.a and the udbg_objects
+// object library for linking udbg into a binary.
+// -DUDBG_LTO=ON builds those two with -flto,
+// -DUDBG_SPLIT_DEBUG=ON adds an unstripped
+// libudbg_debug.so with its dwarf in a .debug file
+// and -DUDBG_SINGLE_HEADER=ON generates
+// udbg_single.h; define UDBG_IMPLEMENTATION in one
+// c source file before including it there.
+// examples/ calls all of the routines below once,
+// built and run by ctest unless -DUDBG_EXAMPLES=OFF
+//
+// build with -DUDBG_FOOTPRINT=ON for small buffers
+// and none of the optional features, or pick them:
+//
+// UDBG_NO_HEXDUMP   hexdump and fingerprint
+// UDBG_NO_BINDUMP   bindump
+// UDBG_NO_DEMANGLE  raw c++ symbols in backtraces
+// UDBG_NO_SIGNALS   no crash handlers, stacks_enable
+//
+// code built against the library needs the same
+// defines; cmake passes them on to its users
+
 
 ///////////////////////////
 ///     routines        ///
 ///////////////////////////
-// main initialization routine; must be called
-// prior to using anything. any udbg call before
-// this results in an undefined behavior
+// main initialization routine. records logged
+// before it, e.g. from static constructors, are
+// kept in memory and written out once the output
+// is open; the channels mask does not apply to
+// them. only the first call takes effect
 // defaults:
 // path - NULL, output to STDERR
 // opt - zero
 // channels - zero, everything enabled by default
 #define udbg_init(path_, opt_, channels_)   __udbg_init_impl(path_, opt_, channels_)
 
+// call at the start of every other thread: installs its own
+// guard-paged alternate signal stack so crashes (stack overflow
+// included) get reported. released at thread exit
+#define udbg_thread_attach()                __udbg_thread_attach_impl()
+
+// log deepest stack usage of every painted thread; the
+// same is logged for each of them at thread exit
+#define udbg_stack_report(ch_)              __udbg_stack_report_impl(ch_, #ch_)
+
+// the same report every interval_s seconds from a background
+// thread, to watch the marks settle; interval zero stops it
+#define udbg_stack_watch(ch_, interval_s_)  __udbg_stack_watch_impl(ch_, #ch_, interval_s_)
+
+// dump stacks of all threads whenever the process receives
+// signal sig from outside (see udbg-stacks); every thread is
+// interrupted only for its own backtrace() call. calls that
+// are never restarted, e.g. epoll_wait(), nanosleep() or
+// sem_timedwait(), may return EINTR in those threads
+#define udbg_stacks_enable(ch_, sig_)       __udbg_stacks_enable_impl(ch_, #ch_, sig_)
+
 // formatted output to some channel
 // [TIME][CHANNEL::function(line)] <message>
 #define udbg_log(channel_, fmt_, ...) \
@@ -46,14 +141,174 @@
 // hex dump some object into log
 #define udbg_hexdump(ch_, ptr_, len_)       __udbg_hexdump_impl(ch_, #ch_, ptr_, len_)
 
+// length, hash and sampled bytes of some object
+#define udbg_fingerprint(ch_, ptr_, len_)   __udbg_fingerprint_impl(ch_, #ch_, ptr_, len_)
+
 // binary dump some object into log
 #define udbg_bindump(ch_, ptr_, len_)       __udbg_bindump_impl(ch_, #ch_, ptr_, len_)
 
+// register a named channel such as "net.tcp.rx"; returns its
+// id, the same one for the same name. up to 8191 channels
+#define udbg_channel(name_)                         __udbg_channel_impl(name_)
+
+// enable named channels by comma separated glob rules, last
+// match wins: "net.*,-net.tcp.*". with only '-' rules the
+// rest stays enabled; everything is enabled by default.
+// "~net.*" enables for sampled requests only
+#define udbg_channels_enable(rules_)                __udbg_channels_enable_impl(rules_)
+
+// formatted output to a named channel; disabled channels cost
+// one byte load at the call site
+// [TIME][name::function(line)] <message>
+#define udbg_logc(id_, fmt_, ...)                   __udbg_logc_impl(id_, fmt_, ##__VA_ARGS__)
+
+// head sampling: sample this fraction of requests, e.g. 0.001
+#define udbg_sample_rate(rate_)                     __udbg_sample_rate_impl(rate_)
+
+// mask channels of udbg_init() output enabled for sampled requests
+#define udbg_channels_sampled(mask_)                __udbg_channels_sampled_impl(mask_)
+
+// start of a request on this thread: decide by a hash of the
+// trace id, so every process agrees on the same requests.
+// returns non-zero if sampled; the decision holds until the
+// next call or udbg_sample_ctx_clear()
+#define udbg_sample_ctx_set(trace_id_)              __udbg_sample_ctx_set_impl(trace_id_)
+#define udbg_sample_ctx_clear()                     __udbg_sample_ctx_clear_impl()
+
+// real-time mode for the udbg_init() output: prefault and
+// mlock all buffers, queue records in memory and leave the
+// writing to a flusher thread pinned to cpu (-1 for any) with
+// the given scheduling policy. records that don't fit the
+// ring are dropped, keeping the log in order; drops, lock
+// contention and per-thread allocations of other threads
+// are counted, see udbg_stats()
+#define udbg_rt(cpu_, policy_, priority_)           __udbg_rt_impl(cpu_, policy_, priority_)
+
+// build one multi-line record per thread and write
+// it with a single lock and write, so other threads
+// cannot interleave. begin returns NULL when the
+// channel is disabled, the other calls accept that.
+// the first append completes the prefix line
+#define udbg_rec_begin(ch_)                 __udbg_rec_begin_impl(ch_, #ch_)
+#define udbg_rec_append(rec_, fmt_, ...)    __udbg_rec_append_impl(rec_, fmt_, ##__VA_ARGS__)
+#define udbg_rec_hexdump(rec_, ptr_, len_)  __udbg_rec_hexdump_impl(rec_, ptr_, len_)
+#define udbg_rec_commit(rec_)               __udbg_rec_commit_impl(rec_)
+
+// independent output with its own file, options, channels
+// and lock; same arguments as udbg_init, no signal handling.
+// NULL if the file can't be opened, the _h calls and close
+// accept that. the calls above without _h go to the
+// udbg_init one
+#define udbg_open(path_, opt_, channels_)           __udbg_open_impl(path_, opt_, channels_)
+#define udbg_close(h_)                              __udbg_close_impl(h_)
+
+#define udbg_log_h(h_, channel_, fmt_, ...) \
+                    __udbg_log_h_impl(h_, channel_, __udbg_prefix(#channel_) fmt_, ##__VA_ARGS__)
+#define udbg_hexdump_h(h_, ch_, ptr_, len_)         __udbg_hexdump_h_impl(h_, ch_, #ch_, ptr_, len_)
+#define udbg_fingerprint_h(h_, ch_, ptr_, len_)     __udbg_fingerprint_h_impl(h_, ch_, #ch_, ptr_, len_)
+#define udbg_bindump_h(h_, ch_, ptr_, len_)         __udbg_bindump_h_impl(h_, ch_, #ch_, ptr_, len_)
+
+// numeric array dump in columns, with a summary header:
+// count, min, max, mean, nan/inf counts, first non-finite index
+#define udbg_arraydump_f32(ch_, ptr_, count_)   __udbg_arraydump_impl(ch_, #ch_, F32, ptr_, count_)
+#define udbg_arraydump_f64(ch_, ptr_, count_)   __udbg_arraydump_impl(ch_, #ch_, F64, ptr_, count_)
+#define udbg_arraydump_i32(ch_, ptr_, count_)   __udbg_arraydump_impl(ch_, #ch_, I32, ptr_, count_)
+#define udbg_arraydump_i64(ch_, ptr_, count_)   __udbg_arraydump_impl(ch_, #ch_, I64, ptr_, count_)
+#define udbg_arraydump_u32(ch_, ptr_, count_)   __udbg_arraydump_impl(ch_, #ch_, U32, ptr_, count_)
+#define udbg_arraydump_u64(ch_, ptr_, count_)   __udbg_arraydump_impl(ch_, #ch_, U64, ptr_, count_)
+
+// time the rest of the enclosing scope; log duration, phases
+// and call stack only if it took longer than budget_us.
+// repeated stacks are printed once, then referred to by hash
+#define udbg_budget_scope(ch_, budget_us_)      __udbg_budget_scope_impl(ch_, #ch_, budget_us_)
+
+// mark a named phase inside the current budget scope
+#define udbg_budget_phase(name_)                __udbg_budget_phase_impl(name_)
+
+// count cycles, instructions, cache and branch misses over the
+// rest of the enclosing scope, accumulated per call site. falls
+// back to task-clock, page faults and context switches when
+// there is no pmu; counters are opened once per thread
+#define udbg_perf_scope(ch_, name_)             __udbg_perf_scope_impl(ch_, #ch_, name_)
+
+// log per call site statistics
+#define udbg_stats(ch_)                         __udbg_stats_impl(ch_, #ch_)
+
+// start a background sampler logging the top count threads
+// by cpu usage every interval_s seconds, along with context
+// switches and page faults; interval zero stops it
+#define udbg_thread_top(ch_, interval_s_, count_) \
+                    __udbg_thread_top_impl(ch_, #ch_, interval_s_, count_)
+
+// rss, anon/file/shmem/huge page breakdown and malloc
+// arena usage; crash reports carry the /proc part too
+#define udbg_mem_report(ch_)                    __udbg_mem_report_impl(ch_, #ch_)
+
+// check rss every interval_s seconds in the background, log
+// a report when it grows faster than growth_kb_s kB per
+// second; interval zero stops it
+#define udbg_mem_watch(ch_, interval_s_, growth_kb_s_) \
+                    __udbg_mem_watch_impl(ch_, #ch_, interval_s_, growth_kb_s_)
+
+// wall-clock profiler: sample stacks of attached threads hz
+// times a second for the given time, whether running or
+// blocked, then log them folded, rooted at on-cpu / off-cpu.
+// uses the udbg_stacks_enable() signal, SIGURG otherwise,
+// logs and refuses if the program has a SIGURG handler;
+// calls never restarted after a signal, e.g. epoll_wait(),
+// return EINTR in sampled threads
+#define udbg_wallprof(ch_, hz_, seconds_)       __udbg_wallprof_impl(ch_, #ch_, hz_, seconds_)
+
+// follow one request across threads and queues: mark where
+// it starts, each hop and where it ends. events go to an
+// in-memory ring, the oldest are overwritten
+#define udbg_flow_begin(id_)                    __udbg_flow_impl(id_, 's')
+#define udbg_flow_step(id_)                     __udbg_flow_impl(id_, 't')
+#define udbg_flow_end(id_)                      __udbg_flow_impl(id_, 'f')
+
+// write recorded flows as chrome trace json, for
+// chrome://tracing or perfetto; one arrow chain per id.
+// returns 0, -1 with errno if path can't be created
+#define udbg_trace_export(path_)                __udbg_trace_export_impl(path_)
+
+// time items through a queue of your own, by queue name,
+// a string literal, and an id unique while queued (a
+// pointer will do): depth, max depth and a log2 histogram
+// of time spent queued go to udbg_stats(). no locks, lost
+// timings are counted
+#define udbg_queue_probe_enqueue(q_, item_)     __udbg_queue_probe_impl(q_, item_, __udbg_queue_enqueue)
+#define udbg_queue_probe_dequeue(q_, item_)     __udbg_queue_probe_impl(q_, item_, __udbg_queue_dequeue)
+
 // throw/panic/terminate
 #define udbg_throw()                        __udbg_throw_impl()
 
 // custom assert
 #define udbg_assert(expr_)                  __udbg_assert_impl(expr_)
 
+// comparison asserts: operands are evaluated once,
+// both values are printed on failure. in c++ any type
+// with the operator works, class values aren't printed
+#define udbg_assert_eq(a_, b_)              __udbg_assert_cmp_impl(a_, ==, b_)
+#define udbg_assert_ne(a_, b_)              __udbg_assert_cmp_impl(a_, !=, b_)
+#define udbg_assert_lt(a_, b_)              __udbg_assert_cmp_impl(a_, <, b_)
+#define udbg_assert_le(a_, b_)              __udbg_assert_cmp_impl(a_, <=, b_)
+#define udbg_assert_gt(a_, b_)              __udbg_assert_cmp_impl(a_, >, b_)
+#define udbg_assert_ge(a_, b_)              __udbg_assert_cmp_impl(a_, >=, b_)
+
+// checks, unlike asserts, stay in builds without UDBG,
+// where a failure is just a trap
+#define udbg_check(expr_)                   __udbg_check_impl(expr_)
+
+// evaluated only without NDEBUG
+#ifdef NDEBUG
+#   define udbg_dcheck(expr_)               ((void) sizeof(!(expr_)))
+#else
+#   define udbg_dcheck(expr_)               __udbg_check_impl(expr_)
+#endif
+
+// for expensive invariants: evaluated on every
+// n-th pass through the site, counted per thread
+#define udbg_check_sampled(expr_, n_)       __udbg_sampled(n_, __udbg_check_impl(expr_))
+
 
 #endif // UDBG_H
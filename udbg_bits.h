@@ -5,17 +5,82 @@
 #ifndef UDBG_BITS_H
 #define UDBG_BITS_H
 
+// element types for array dumps
+#define __UDBG_F32 1
+#define __UDBG_F64 2
+#define __UDBG_I32 3
+#define __UDBG_I64 4
+#define __UDBG_U32 5
+#define __UDBG_U64 6
+
+// named channel ids; one enable byte each
+#ifndef __UDBG_NAMED_MAX
+#define __UDBG_NAMED_MAX 8192
+#endif
+
+// every n-th evaluation of a sampled check, per thread and site
+#define __udbg_sampled(n_, check_)                                      \
+    ({static __thread unsigned __udbg_tick_;                            \
+    if (++__udbg_tick_ >= (unsigned) (n_)){                             \
+    __udbg_tick_ = 0; check_;}})
+
+// independent output, see udbg_open()
+typedef struct udbg_instance udbg_t;
+
+// record being built, see udbg_rec_begin()
+typedef struct udbg_rec udbg_rec_t;
+
 /*
  *  define empty statements here
  */
 #ifndef UDBG
 
 #define __udbg_init_impl(path_, opt_, channels_)
+#define __udbg_thread_attach_impl()
+#define __udbg_stack_report_impl(ch_, label_)
+#define __udbg_stack_watch_impl(ch_, label_, interval_)
+#define __udbg_stacks_enable_impl(ch_, label_, sig_)
 #define __udbg_log_impl(ch_, fmt_, ...)
+#define __udbg_open_impl(path_, opt_, channels_) ((udbg_t *) 0)
+#define __udbg_channel_impl(name_) 0
+#define __udbg_rt_impl(cpu_, policy_, priority_)
+#define __udbg_rec_begin_impl(ch_, label_) ((udbg_rec_t *) 0)
+#define __udbg_rec_append_impl(rec_, fmt_, ...)
+#define __udbg_rec_hexdump_impl(rec_, ptr_, len_)
+#define __udbg_rec_commit_impl(rec_)
+#define __udbg_channels_enable_impl(rules_)
+#define __udbg_channels_sampled_impl(mask_)
+#define __udbg_sample_rate_impl(rate_)
+#define __udbg_sample_ctx_set_impl(id_) 0
+#define __udbg_sample_ctx_clear_impl()
+#define __udbg_logc_impl(id_, fmt_, ...)
+#define __udbg_close_impl(h_)
+#define __udbg_log_h_impl(h_, ch_, fmt_, ...)
+#define __udbg_hexdump_h_impl(h_, ch_, label_, ptr_, len_)
+#define __udbg_fingerprint_h_impl(h_, ch_, label_, ptr_, len_)
+#define __udbg_bindump_h_impl(h_, ch_, label_, ptr_, len_)
 #define __udbg_hexdump_impl(ch_, label_, ptr_, len_)
+#define __udbg_fingerprint_impl(ch_, label_, ptr_, len_)
 #define __udbg_bindump_impl(ch_, label_, ptr_, len_)
+#define __udbg_arraydump_impl(ch_, label_, type_, ptr_, count_)
+#define __udbg_budget_scope_impl(ch_, label_, budget_us_)
+#define __udbg_budget_phase_impl(name_)
+#define __udbg_perf_scope_impl(ch_, label_, name_)
+#define __udbg_stats_impl(ch_, label_)
+#define __udbg_thread_top_impl(ch_, label_, interval_, count_)
+#define __udbg_mem_report_impl(ch_, label_)
+#define __udbg_wallprof_impl(ch_, label_, hz_, seconds_)
+#define __udbg_flow_impl(id_, phase_)
+#define __udbg_trace_export_impl(path_) 0
+#define __udbg_queue_probe_impl(q_, item_, fn_)
+#define __udbg_mem_watch_impl(ch_, label_, interval_, growth_)
 #define __udbg_throw_impl()
 #define __udbg_assert_impl(expr_)
+#define __udbg_assert_cmp_impl(a_, op_, b_)
+
+// checks stay, without a report
+#define __udbg_check_impl(expr_) \
+    ({if (__builtin_expect(!(expr_), 0)){ __builtin_trap();}})
 
 #else // UDBG
 
@@ -24,6 +89,7 @@
 
 #ifdef __cplusplus
 #   include <cstdint>
+#   include <ctime>
 #   include <cxxabi.h>
 #   undef __udbg_demangle
 
@@ -40,19 +106,227 @@
 extern "C" {
 #else
 #   include <stdint.h>
+#   include <time.h>
 #endif
 
+// everything else in libudbg is built with hidden visibility
+#if defined(__GNUC__) || defined(__clang__)
+#   define __UDBG_API __attribute__((visibility("default")))
+#else
+#   define __UDBG_API
+#endif
+
+#define __UDBG_BUDGET_PHASES 8
+
+// state of one udbg_budget_scope
+typedef struct
+{
+    uint64_t channel;
+    const char *prefix;
+    const char *function;
+    unsigned line;
+
+    uint64_t budget_ns;
+    uint64_t start_ns;
+
+    int phases;
+    uint64_t phase_ns[__UDBG_BUDGET_PHASES];
+    const char *phase_name[__UDBG_BUDGET_PHASES];
+
+} __udbg_budget;
+
+// where an assert sits; static, so a failing
+// site passes a single pointer to the cold path
+typedef struct
+{
+    const char *kind;
+    const char *expr;
+    const char *function;
+    const char *file;
+    unsigned line;
+
+} __udbg_site;
+
+#define __UDBG_VALUE_NONE 0
+#define __UDBG_VALUE_I 1
+#define __UDBG_VALUE_U 2
+#define __UDBG_VALUE_F 3
+#define __UDBG_VALUE_P 4
+
+// operand of a failed comparison assert
+typedef struct
+{
+    int type;
+    union
+    {
+        int64_t i;
+        uint64_t u;
+        double f;
+        const volatile void *p;
+    };
+
+} __udbg_value;
+
+#define __UDBG_PERF_COUNTERS 4
+
+// statistics of one udbg_perf_scope call site
+typedef struct __udbg_perf_site
+{
+    struct __udbg_perf_site *next;
+    const char *prefix;
+    const char *name;
+    const char *function;
+    unsigned line;
+
+    // counter set, zero until first recorded call
+    int mode;
+    uint64_t calls;
+    uint64_t counters[__UDBG_PERF_COUNTERS];
+
+} __udbg_perf_site;
+
+// state of one udbg_perf_scope
+typedef struct
+{
+    __udbg_perf_site *site;
+    int mode;
+    uint64_t start[__UDBG_PERF_COUNTERS];
+
+} __udbg_perf;
+
 // direct calls
-void __udbg_init(void *, const char *, int, uint64_t);
-void __udbg_throwfmt(const char *, ...);
-void __udbg_log(uint64_t, const char *, ...);
-void __udbg_hexdump(uint64_t, const char *, const void *, int);
-void __udbg_bindump(uint64_t, const char *, const void *, int);
+__UDBG_API void __udbg_init(void *, const char *, int, uint64_t);
+__UDBG_API void __udbg_thread_attach(void);
+__UDBG_API void __udbg_stack_report(uint64_t, const char *);
+__UDBG_API void __udbg_stack_watch(uint64_t, const char *, int);
+__UDBG_API void __udbg_stacks_enable(uint64_t, const char *, int);
+__UDBG_API void __udbg_throwfmt(const char *, ...) __attribute__((noreturn));
+__UDBG_API void __udbg_assert_fail(const __udbg_site *)
+    __attribute__((cold, noinline, noreturn));
+__UDBG_API void __udbg_assert_cmp_fail(const __udbg_site *, __udbg_value, __udbg_value)
+    __attribute__((cold, noinline, noreturn));
+__UDBG_API void __udbg_log(uint64_t, const char *, ...);
+__UDBG_API void __udbg_hexdump(uint64_t, const char *, const void *, int);
+__UDBG_API void __udbg_fingerprint(uint64_t, const char *, const void *, int);
+__UDBG_API void __udbg_bindump(uint64_t, const char *, const void *, int);
+__UDBG_API udbg_t *__udbg_open(const char *, int, uint64_t);
+__UDBG_API void __udbg_close(udbg_t *);
+__UDBG_API void __udbg_log_h(udbg_t *, uint64_t, const char *, ...);
+__UDBG_API void __udbg_hexdump_h(udbg_t *, uint64_t, const char *, const void *, int);
+__UDBG_API void __udbg_fingerprint_h(udbg_t *, uint64_t, const char *, const void *, int);
+__UDBG_API void __udbg_bindump_h(udbg_t *, uint64_t, const char *, const void *, int);
+
+__UDBG_API int __udbg_channel(const char *);
+__UDBG_API void __udbg_channels_enable(const char *);
+__UDBG_API void __udbg_logc(int, const char *, ...);
+__UDBG_API extern uint8_t __udbg_named_on[__UDBG_NAMED_MAX];
+
+__UDBG_API extern __thread uint8_t __udbg_ctx_sampled __attribute__((tls_model("initial-exec")));
+__UDBG_API void __udbg_channels_sampled(uint64_t);
+__UDBG_API void __udbg_sample_rate(double);
+__UDBG_API int __udbg_sample_ctx_set(uint64_t);
+
+__UDBG_API void __udbg_rt(int, int, int);
+__UDBG_API udbg_rec_t *__udbg_rec_begin(uint64_t, const char *, ...);
+__UDBG_API void __udbg_rec_append(udbg_rec_t *, const char *, ...);
+__UDBG_API void __udbg_rec_hexdump(udbg_rec_t *, const char *, const void *, int);
+__UDBG_API void __udbg_rec_commit(udbg_rec_t *);
+__UDBG_API void __udbg_arraydump(uint64_t, const char *, int, const void *, int);
+__UDBG_API void __udbg_budget_report(const __udbg_budget *, uint64_t);
+__UDBG_API __udbg_perf __udbg_perf_begin(uint64_t, __udbg_perf_site *);
+__UDBG_API void __udbg_perf_end(const __udbg_perf *);
+__UDBG_API void __udbg_stats(uint64_t, const char *);
+__UDBG_API void __udbg_thread_top(uint64_t, const char *, int, int);
+__UDBG_API void __udbg_mem_report(uint64_t, const char *);
+__UDBG_API void __udbg_mem_watch(uint64_t, const char *, int, int);
+__UDBG_API void __udbg_wallprof(uint64_t, const char *, int, int);
+__UDBG_API void __udbg_flow(uint64_t, int, const char *, unsigned);
+__UDBG_API int __udbg_trace_export(const char *);
+__UDBG_API struct __udbg_queue *__udbg_queue_get(const char *);
+__UDBG_API void __udbg_queue_enqueue(struct __udbg_queue *, uint64_t);
+__UDBG_API void __udbg_queue_dequeue(struct __udbg_queue *, uint64_t);
 
 #ifdef __cplusplus
 }
 #endif // __cplusplus
 
+// vdso backed, no syscall on the fast path
+static inline uint64_t __udbg_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// scope exit: one more clock read and a compare
+static inline void __udbg_budget_check(const __udbg_budget *scope)
+{
+    const uint64_t now = __udbg_now_ns();
+    if (now - scope->start_ns > scope->budget_ns)
+    {
+        __udbg_budget_report(scope, now);
+    }
+}
+
+// operands of comparison asserts, by type
+#ifdef __cplusplus
+#   define __udbg_auto const auto &
+#   define __UDBG_VALUE_OF(type_, kind_, field_) \
+    static inline __udbg_value __udbg_value_of(type_ v) \
+    { __udbg_value r; r.type = kind_; r.field_ = v; return r; }
+
+__UDBG_VALUE_OF(bool, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(char, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(signed char, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(short, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(int, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(long, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(long long, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(unsigned char, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(unsigned short, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(unsigned int, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(unsigned long, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(unsigned long long, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(float, __UDBG_VALUE_F, f)
+__UDBG_VALUE_OF(double, __UDBG_VALUE_F, f)
+__UDBG_VALUE_OF(long double, __UDBG_VALUE_F, f)
+__UDBG_VALUE_OF(const volatile void *, __UDBG_VALUE_P, p)
+
+#   undef __UDBG_VALUE_OF
+
+// class types (operator== and friends) compare fine, but have no value to print
+template <typename T>
+static inline auto __udbg_value_pick(const T &v, int) -> decltype(__udbg_value_of(v))
+{ return __udbg_value_of(v); }
+template <typename T>
+static inline __udbg_value __udbg_value_pick(const T &, long)
+{ __udbg_value r; r.type = __UDBG_VALUE_NONE; r.u = 0; return r; }
+
+#   define __udbg_value(x_) __udbg_value_pick(x_, 0)
+#else
+#   define __udbg_auto __auto_type
+#   define __UDBG_VALUE_OF(name_, type_, kind_, field_) \
+    static inline __udbg_value name_(type_ v) \
+    { __udbg_value r; r.type = kind_; r.field_ = v; return r; }
+
+__UDBG_VALUE_OF(__udbg_value_i, int64_t, __UDBG_VALUE_I, i)
+__UDBG_VALUE_OF(__udbg_value_u, uint64_t, __UDBG_VALUE_U, u)
+__UDBG_VALUE_OF(__udbg_value_f, double, __UDBG_VALUE_F, f)
+__UDBG_VALUE_OF(__udbg_value_p, const volatile void *, __UDBG_VALUE_P, p)
+
+#   undef __UDBG_VALUE_OF
+#   define __udbg_value(x_) _Generic((x_),                               \
+    _Bool: __udbg_value_u, char: __udbg_value_i,                        \
+    signed char: __udbg_value_i, short: __udbg_value_i,                 \
+    int: __udbg_value_i, long: __udbg_value_i, long long: __udbg_value_i, \
+    unsigned char: __udbg_value_u, unsigned short: __udbg_value_u,      \
+    unsigned int: __udbg_value_u, unsigned long: __udbg_value_u,        \
+    unsigned long long: __udbg_value_u, float: __udbg_value_f,          \
+    double: __udbg_value_f, long double: __udbg_value_f,                \
+    default: __udbg_value_p)(x_)
+#endif
+
 // log format prefix:
 // need to pass channel as string
 #define __udbg_prefix(ch_) "[" ch_ "::%s(%u)] "
@@ -60,23 +334,180 @@ void __udbg_bindump(uint64_t, const char *, const void *, int);
 //
 #define __udbg_init_impl(path_, opt_, channels_) \
     __udbg_init(__udbg_demangle, path_, opt_, channels_)
+#define __udbg_thread_attach_impl() \
+    __udbg_thread_attach()
+#define __udbg_stack_report_impl(ch_, label_) \
+    __udbg_stack_report(ch_, "[" label_ "::stack]")
+#define __udbg_stack_watch_impl(ch_, label_, interval_) \
+    __udbg_stack_watch(ch_, "[" label_ "::stack]", interval_)
+#define __udbg_stacks_enable_impl(ch_, label_, sig_) \
+    __udbg_stacks_enable(ch_, "[" label_ "::stacks]", sig_)
 #define __udbg_log_impl(channel_, fmt_, ...) \
     __udbg_log(channel_, fmt_ "\n", __FUNCTION__, __LINE__,  ##__VA_ARGS__)
 
 #define __udbg_hexdump_impl(ch_, label_, ptr_, len_) \
     __udbg_hexdump(ch_, "[" label_ "::hexdump] " #ptr_ ", " #len_, ptr_, len_)
+#define __udbg_fingerprint_impl(ch_, label_, ptr_, len_) \
+    __udbg_fingerprint(ch_, "[" label_ "::fingerprint] " #ptr_ ", " #len_, ptr_, len_)
 #define __udbg_bindump_impl(ch_, label_, ptr_, len_) \
     __udbg_bindump(ch_, "[" label_ "::bindump] " #ptr_ ", " #len_, ptr_, len_)
+#define __udbg_open_impl(path_, opt_, channels_) \
+    __udbg_open(path_, opt_, channels_)
+#define __udbg_channel_impl(name_) \
+    __udbg_channel(name_)
+#define __udbg_rt_impl(cpu_, policy_, priority_) \
+    __udbg_rt(cpu_, policy_, priority_)
+#define __udbg_rec_begin_impl(ch_, label_) \
+    __udbg_rec_begin(ch_, __udbg_prefix(label_), __FUNCTION__, __LINE__)
+#define __udbg_rec_append_impl(rec_, fmt_, ...) \
+    __udbg_rec_append(rec_, fmt_ "\n", ##__VA_ARGS__)
+#define __udbg_rec_hexdump_impl(rec_, ptr_, len_) \
+    __udbg_rec_hexdump(rec_, #ptr_ ", " #len_, ptr_, len_)
+#define __udbg_rec_commit_impl(rec_) \
+    __udbg_rec_commit(rec_)
+#define __udbg_channels_enable_impl(rules_) \
+    __udbg_channels_enable(rules_)
+#define __udbg_channels_sampled_impl(mask_) \
+    __udbg_channels_sampled(mask_)
+#define __udbg_sample_rate_impl(rate_) \
+    __udbg_sample_rate(rate_)
+#define __udbg_sample_ctx_set_impl(id_) \
+    __udbg_sample_ctx_set(id_)
+#define __udbg_sample_ctx_clear_impl() \
+    (__udbg_ctx_sampled = 0)
+
+// enable byte: bit0 on, bit1 on for sampled requests;
+// id_ may be a udbg_channel() call, evaluated once
+#define __udbg_logc_impl(id_, fmt_, ...)                                    \
+    ({__udbg_auto __udbg_id = (id_);                                        \
+    if (__udbg_named_on[__udbg_id] & (1 | __udbg_ctx_sampled)){             \
+    __udbg_logc(__udbg_id, "%s(%u)] " fmt_ "\n", __FUNCTION__, __LINE__,    \
+    ##__VA_ARGS__);}})
+#define __udbg_close_impl(h_) \
+    __udbg_close(h_)
+#define __udbg_log_h_impl(h_, channel_, fmt_, ...) \
+    __udbg_log_h(h_, channel_, fmt_ "\n", __FUNCTION__, __LINE__,  ##__VA_ARGS__)
+#define __udbg_hexdump_h_impl(h_, ch_, label_, ptr_, len_) \
+    __udbg_hexdump_h(h_, ch_, "[" label_ "::hexdump] " #ptr_ ", " #len_, ptr_, len_)
+#define __udbg_fingerprint_h_impl(h_, ch_, label_, ptr_, len_) \
+    __udbg_fingerprint_h(h_, ch_, "[" label_ "::fingerprint] " #ptr_ ", " #len_, ptr_, len_)
+#define __udbg_bindump_h_impl(h_, ch_, label_, ptr_, len_) \
+    __udbg_bindump_h(h_, ch_, "[" label_ "::bindump] " #ptr_ ", " #len_, ptr_, len_)
+
+#define __udbg_arraydump_impl(ch_, label_, type_, ptr_, count_) \
+    __udbg_arraydump(ch_, "[" label_ "::arraydump] " #ptr_ ", " #count_, \
+    __UDBG_##type_, ptr_, count_)
+
+#define __udbg_budget_scope_impl(ch_, label_, budget_us_)                     \
+    __attribute__((cleanup(__udbg_budget_check)))                           \
+    __udbg_budget __udbg_budget_scope = {ch_, "[" label_ "::budget] ",      \
+    __FUNCTION__, __LINE__, (uint64_t) (budget_us_) * 1000, __udbg_now_ns(), \
+    0, {0}, {0}}
+
+#define __udbg_budget_phase_impl(name_)                                     \
+    ({if (__udbg_budget_scope.phases < __UDBG_BUDGET_PHASES){               \
+    __udbg_budget_scope.phase_name[__udbg_budget_scope.phases] = name_;     \
+    __udbg_budget_scope.phase_ns[__udbg_budget_scope.phases++] =            \
+    __udbg_now_ns();}})
+
+#define __udbg_perf_scope_impl(ch_, label_, name_)                          \
+    static __udbg_perf_site __udbg_perf_site_ = {NULL,                      \
+    "[" label_ "::perf] ", name_, __FUNCTION__, __LINE__, 0, 0, {0}};       \
+    __attribute__((cleanup(__udbg_perf_end)))                               \
+    __udbg_perf __udbg_perf_scope = __udbg_perf_begin(ch_, &__udbg_perf_site_)
+
+#define __udbg_stats_impl(ch_, label_) \
+    __udbg_stats(ch_, "[" label_ "::stats]")
+
+#define __udbg_thread_top_impl(ch_, label_, interval_, count_) \
+    __udbg_thread_top(ch_, "[" label_ "::threadtop]", interval_, count_)
 
-// wrappers
-#define __udbg_assert_impl(expr_)                       \
-    ({if (!(expr_)){                                    \
-    __udbg_throwfmt("[udbg::assert] %s\n%s() %s:%d\n",  \
-    #expr_, __FUNCTION__, __FILE__, __LINE__);}})       \
+#define __udbg_mem_report_impl(ch_, label_) \
+    __udbg_mem_report(ch_, "[" label_ "::mem]")
+#define __udbg_wallprof_impl(ch_, label_, hz_, seconds_) \
+    __udbg_wallprof(ch_, "[" label_ "::wallprof]", hz_, seconds_)
+#define __udbg_mem_watch_impl(ch_, label_, interval_, growth_) \
+    __udbg_mem_watch(ch_, "[" label_ "::mem]", interval_, growth_)
+
+#define __udbg_flow_impl(id_, phase_) \
+    __udbg_flow(id_, phase_, __FUNCTION__, __LINE__)
+#define __udbg_trace_export_impl(path_) \
+    __udbg_trace_export(path_)
+
+// the queue is looked up by name once per call site,
+// so the name must be a literal
+#define __udbg_queue_probe_impl(q_, item_, fn_)                             \
+    ({static struct __udbg_queue *__udbg_queue_;                            \
+    struct __udbg_queue *__udbg_q_ =                                        \
+    __atomic_load_n(&__udbg_queue_, __ATOMIC_ACQUIRE);                      \
+    if (__builtin_expect(__udbg_q_ == NULL, 0)){                            \
+    __udbg_q_ = __udbg_queue_get("" q_ "");                                 \
+    __atomic_store_n(&__udbg_queue_, __udbg_q_, __ATOMIC_RELEASE);}         \
+    fn_(__udbg_q_, (uint64_t) (item_));})
+
+// wrappers; failure is a call to a cold stub, strings
+// and the call stay out of the hot path
+#define __udbg_site_fail(kind_, expr_)                                  \
+    ({if (__builtin_expect(!(expr_), 0)){                               \
+    static const __udbg_site __udbg_site_ =                             \
+    {kind_, #expr_, __FUNCTION__, __FILE__, __LINE__};                  \
+    __udbg_assert_fail(&__udbg_site_);}})
+
+#define __udbg_assert_impl(expr_) \
+    __udbg_site_fail("assert", expr_)
+#define __udbg_check_impl(expr_) \
+    __udbg_site_fail("check", expr_)
+
+// operands evaluated once
+#define __udbg_assert_cmp_impl(a_, op_, b_)                             \
+    ({__udbg_auto __udbg_a = (a_);                                      \
+    __udbg_auto __udbg_b = (b_);                                        \
+    if (__builtin_expect(!(__udbg_a op_ __udbg_b), 0)){                 \
+    static const __udbg_site __udbg_site_ =                             \
+    {"assert", #a_ " " #op_ " " #b_, __FUNCTION__, __FILE__, __LINE__}; \
+    __udbg_assert_cmp_fail(&__udbg_site_,                               \
+    __udbg_value(__udbg_a), __udbg_value(__udbg_b));}})
 
 #define __udbg_throw_impl()                             \
     __udbg_throwfmt("[udbg::throw] %s() %s:%u\n",       \
     __FUNCTION__, __FILE__, __LINE__)                   \
 
 #endif // UDBG
+
+/*
+ *  features left out of a footprint build
+ *  compile to nothing at call sites as well
+ */
+#ifdef UDBG_NO_HEXDUMP
+#   undef __udbg_hexdump_impl
+#   undef __udbg_hexdump_h_impl
+#   undef __udbg_fingerprint_impl
+#   undef __udbg_fingerprint_h_impl
+#   undef __udbg_rec_hexdump_impl
+#   define __udbg_hexdump_impl(ch_, label_, ptr_, len_)
+#   define __udbg_hexdump_h_impl(h_, ch_, label_, ptr_, len_)
+#   define __udbg_fingerprint_impl(ch_, label_, ptr_, len_)
+#   define __udbg_fingerprint_h_impl(h_, ch_, label_, ptr_, len_)
+#   define __udbg_rec_hexdump_impl(rec_, ptr_, len_)
+#endif
+
+#ifdef UDBG_NO_BINDUMP
+#   undef __udbg_bindump_impl
+#   undef __udbg_bindump_h_impl
+#   define __udbg_bindump_impl(ch_, label_, ptr_, len_)
+#   define __udbg_bindump_h_impl(h_, ch_, label_, ptr_, len_)
+#endif
+
+#ifdef UDBG_NO_DEMANGLE
+#   undef __udbg_demangle
+#   define __udbg_demangle NULL
+#endif
+
+#ifdef UDBG_NO_SIGNALS
+#   undef __udbg_stacks_enable_impl
+#   undef __udbg_wallprof_impl
+#   define __udbg_stacks_enable_impl(ch_, label_, sig_)
+#   define __udbg_wallprof_impl(ch_, label_, hz_, seconds_)
+#endif
+
 #endif // UDBG_BITS_H